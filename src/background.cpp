@@ -0,0 +1,325 @@
+#include "background.h"
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <linux/ioprio.h>
+#include <sched.h>
+#include <set>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <thread>
+#include <unistd.h>
+
+#define CGROUP_NAME "tmpfs_switch_build"
+// How often /proc/pressure is looked at
+#define PRESSURE_INTERVAL chrono::milliseconds{250}
+// Stall share of the others that makes the build back off
+#define PRESSURE_BACKOFF_PERCENT 10
+// The build keeps at least this share of the time
+#define MIN_SHARE (1.0 / 8)
+
+using namespace std;
+
+namespace {
+void Warn(const string &what) {
+  cerr << "Background: " << what << " failed " << errno << endl;
+}
+
+bool WriteFile(const string &path, const string &value) {
+  ofstream f{path};
+  if (!(f << value << flush)) {
+    Warn("writing " + value + " to " + path);
+    return false;
+  }
+  return true;
+}
+
+[[nodiscard]] string Cgroup2Mount() {
+  ifstream mountinfo{"/proc/self/mountinfo"};
+  for (string l{}; getline(mountinfo, l);) {
+    const size_t sep = l.find(" - ");
+    if (sep == string::npos || l.compare(sep + 3, 8, "cgroup2 "))
+      continue;
+    istringstream fields{l};
+    string ignored{}, mountpoint{};
+    if (fields >> ignored >> ignored >> ignored >> ignored >> mountpoint)
+      return mountpoint;
+  }
+  return {};
+}
+
+// io.max takes whole disks, so partitions are traded for their disk
+[[nodiscard]] string DiskOf(const char *path) {
+  struct stat st {};
+  if (stat(path, &st) || !major(st.st_dev))
+    return {};
+  const string sysfs{"/sys/dev/block/" + to_string(major(st.st_dev)) + ':' +
+                     to_string(minor(st.st_dev))};
+  string disk{};
+  ifstream dev{filesystem::exists(sysfs + "/partition") ? sysfs + "/../dev"
+                                                         : sysfs + "/dev"};
+  return getline(dev, disk) ? disk : string{};
+}
+
+// Our cgroup v2, unless that is the root and so everybody's
+[[nodiscard]] string OwnCgroup() {
+  ifstream self{"/proc/self/cgroup"};
+  for (string l{}; getline(self, l);) {
+    if (l.starts_with("0::/") && l.size() > "0::/"sv.size())
+      return Cgroup2Mount() + l.substr("0::"sv.size());
+  }
+  return {};
+}
+
+// Where the process was and the cgroup it moved to
+string left_cgroup{}, joined_cgroup{};
+
+void JoinCgroup(const BackgroundOptions &options) {
+  const string mount{Cgroup2Mount()};
+  if (mount.empty()) {
+    cerr << "Background: no cgroup2 hierarchy, staying put" << endl;
+    return;
+  }
+  // A sibling, as our own cgroup can't take controllers while it has
+  // processes. The parent must be ours to write, or we'd leave our unit.
+  const string own{OwnCgroup()};
+  const string parent{own.empty() ? mount : own.substr(0, own.rfind('/'))};
+  if (access((parent + "/cgroup.procs").c_str(), W_OK) ||
+      access((parent + "/cgroup.subtree_control").c_str(), W_OK)) {
+    cerr << "Background: " << parent << " is not delegated, staying put"
+         << endl;
+    return;
+  }
+  // Per process, so two builds don't share limits or remove each other's
+  const string cgroup{parent + "/" CGROUP_NAME "." + to_string(getpid())};
+  static_cast<void>(WriteFile(parent + "/cgroup.subtree_control",
+                              "+io +memory"));
+  if (mkdir(cgroup.c_str(), 0755) && errno != EEXIST) {
+    Warn("creating " + cgroup);
+    return;
+  }
+  if (options.max_bytes) {
+    set<string> disks{DiskOf("/"), DiskOf("/usr")};
+    disks.erase(string{});
+    for (const string &disk : disks)
+      static_cast<void>(WriteFile(cgroup + "/io.max",
+                                  disk + " rbps=" +
+                                      to_string(options.max_bytes)));
+  }
+  if (options.memory_high)
+    static_cast<void>(WriteFile(cgroup + "/memory.high",
+                                to_string(options.memory_high)));
+  if (!WriteFile(cgroup + "/cgroup.procs", "0")) {
+    static_cast<void>(rmdir(cgroup.c_str()));
+    return;
+  }
+  left_cgroup = own.empty() ? mount : own;
+  joined_cgroup = cgroup;
+  if (atexit(LeaveBackground))
+    abort();
+}
+
+// Positive whole numbers only, so a typo doesn't silently mean no limit
+[[nodiscard]] size_t ParseCount(string_view arg, string_view flag) {
+  const string_view value{arg.substr(flag.size())};
+  size_t count = 0;
+  for (const char c : value) {
+    if (c < '0' || c > '9' || count > SIZE_MAX / 10) {
+      count = 0;
+      break;
+    }
+    count = count * 10 + static_cast<size_t>(c - '0');
+  }
+  if (!count) {
+    cerr << flag.substr(0, flag.size() - 1) << " takes a positive whole number"
+         << endl;
+    exit(1);
+  }
+  return count;
+}
+
+// Microseconds some task stalled according to PSI files like
+// /proc/pressure/io
+[[nodiscard]] unsigned long long Stall(const string &io, const string &cpu) {
+  unsigned long long total = 0;
+  for (const string *resource : {&io, &cpu}) {
+    ifstream f{*resource};
+    string l{};
+    if (!getline(f, l) || !l.starts_with("some "))
+      continue;
+    const size_t at = l.find(" total=");
+    if (at != string::npos)
+      total += strtoull(l.c_str() + at + " total="sv.size(), nullptr, 10);
+  }
+  return total;
+}
+
+// Microseconds our threads waited for a CPU or, with delay accounting on, for
+// IO. Children aren't covered, and exiting threads take theirs along.
+[[nodiscard]] unsigned long long TaskStall() {
+  unsigned long long total = 0;
+  error_code ec{};
+  for (const auto &task :
+       filesystem::directory_iterator{"/proc/self/task", ec}) {
+    unsigned long long running{}, waiting_ns{}, blkio_ticks{};
+    ifstream schedstat{task.path() / "schedstat"};
+    if (schedstat >> running >> waiting_ns)
+      total += waiting_ns / 1000;
+    ifstream stat{task.path() / "stat"};
+    string l{};
+    if (!getline(stat, l))
+      continue;
+    // The command may contain anything but ends in the last ')'
+    istringstream fields{l.substr(l.rfind(')') + 2)};
+    string field{};
+    for (int i = 3; i < 42 && fields >> field; ++i)
+      ;
+    if (fields >> blkio_ticks)
+      total += blkio_ticks * (1000000 / sysconf(_SC_CLK_TCK));
+  }
+  return total;
+}
+} // namespace
+
+bool ParseBackgroundArg(string_view arg, BackgroundOptions &options) {
+  if (arg == "--background") {
+    options.idle = true;
+  } else if (arg == "--cgroup") {
+    options.cgroup = true;
+  } else if (arg.starts_with("--max-rate=")) {
+    options.max_bytes = ParseCount(arg, "--max-rate=") << 20;
+  } else if (arg.starts_with("--max-files=")) {
+    options.max_files = ParseCount(arg, "--max-files=");
+  } else if (arg.starts_with("--memory-high=")) {
+    options.memory_high = ParseCount(arg, "--memory-high=") << 20;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void EnterBackground(const BackgroundOptions &options) {
+  if (options.idle) {
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)))
+      Warn("idle IO priority");
+    const sched_param param{};
+    if (sched_setscheduler(0, SCHED_IDLE, &param))
+      Warn("SCHED_IDLE");
+    // Still matters where SCHED_IDLE is refused
+    if (setpriority(PRIO_PROCESS, 0, 19))
+      Warn("nice");
+  }
+  if (options.cgroup)
+    JoinCgroup(options);
+}
+
+void LeaveBackground() {
+  if (joined_cgroup.empty())
+    return;
+  static_cast<void>(WriteFile(left_cgroup + "/cgroup.procs", "0"));
+  // Busy while a child that outlived us is still inside, the last one out
+  // removes it
+  if (rmdir(joined_cgroup.c_str()) && errno != EBUSY)
+    Warn("removing " + joined_cgroup);
+  joined_cgroup.clear();
+}
+
+Throttle::Stalls Throttle::ReadStalls() const {
+  return {
+      .all = Stall("/proc/pressure/io", "/proc/pressure/cpu"),
+      .own = own_cgroup_.empty() ? TaskStall()
+                                 : Stall(own_cgroup_ + "/io.pressure",
+                                         own_cgroup_ + "/cpu.pressure"),
+  };
+}
+
+void Throttle::Start(const BackgroundOptions &options) {
+  options_ = options;
+  active_ = options.idle || options.max_bytes || options.max_files;
+  refilled_ = checked_ = Clock::now();
+  bytes_ = static_cast<double>(options.max_bytes);
+  files_ = static_cast<double>(options.max_files);
+  own_cgroup_ = OwnCgroup();
+  stalls_ = ReadStalls();
+}
+
+Throttle::Clock::duration Throttle::Backoff(Clock::time_point now) {
+  const auto elapsed = now - checked_;
+  if (elapsed < PRESSURE_INTERVAL)
+    return {};
+  const Stalls stalls = ReadStalls();
+  // Roughly what the others stalled, as both count overlapping stalls once
+  const unsigned long long all = stalls.all - stalls_.all;
+  const unsigned long long own =
+      stalls.own > stalls_.own ? stalls.own - stalls_.own : 0;
+  const auto elapsed_us =
+      chrono::duration_cast<chrono::microseconds>(elapsed).count();
+  const bool pressure =
+      all > own && (all - own) * 100 > static_cast<unsigned long long>(
+                                            elapsed_us) *
+                                            PRESSURE_BACKOFF_PERCENT;
+  checked_ = now;
+  stalls_ = stalls;
+  // Halve quickly, recover gradually
+  share_ = pressure ? max(share_ / 2, MIN_SHARE) : min(share_ * 1.25, 1.0);
+  return chrono::duration_cast<Clock::duration>(elapsed * (1 / share_ - 1));
+}
+
+void Throttle::Pace(size_t bytes, size_t files) {
+  if (!active_)
+    return;
+  const lock_guard lock{mutex_};
+  const Clock::time_point now = Clock::now();
+  const double seconds = chrono::duration<double>(now - refilled_).count();
+  refilled_ = now;
+  double wait = 0;
+  // Buckets hold at most one second's worth
+  const auto take = [seconds, &wait](double &tokens, size_t rate, size_t used) {
+    if (!rate)
+      return;
+    const double r = static_cast<double>(rate);
+    tokens = min(tokens + r * seconds, r) - static_cast<double>(used);
+    if (tokens < 0)
+      wait = max(wait, -tokens / r);
+  };
+  take(bytes_, options_.max_bytes, bytes);
+  take(files_, options_.max_files, files);
+  Clock::duration sleep{
+      chrono::duration_cast<Clock::duration>(chrono::duration<double>{wait})};
+  if (options_.idle)
+    sleep += Backoff(now);
+  if (sleep <= Clock::duration{})
+    return;
+  this_thread::sleep_for(sleep);
+  delay_ += sleep;
+  // The wait pays off the debt, a backoff on top earns nothing
+  if (options_.max_bytes)
+    bytes_ += static_cast<double>(options_.max_bytes) * wait;
+  if (options_.max_files)
+    files_ += static_cast<double>(options_.max_files) * wait;
+  refilled_ = Clock::now();
+  if (options_.idle) {
+    checked_ = refilled_;
+    stalls_ = ReadStalls();
+  }
+}
+
+size_t Throttle::Chunk() const {
+  if (!active_)
+    return SIZE_MAX;
+  return options_.max_bytes ? max<size_t>(min<size_t>(options_.max_bytes / 4,
+                                                      1ul << 20),
+                                          64ul << 10)
+                            : 1ul << 20;
+}
+
+chrono::milliseconds Throttle::Delay() {
+  const lock_guard lock{mutex_};
+  return chrono::duration_cast<chrono::milliseconds>(delay_);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// How much room a build leaves to the services already running on the host
+struct BackgroundOptions {
+  // Idle IO class, SCHED_IDLE and backing off under IO or CPU pressure
+  bool idle;
+  // Per second, 0 for no limit
+  size_t max_bytes;
+  size_t max_files;
+  // Move into a cgroup of our own with io.max and memory.high set
+  bool cgroup;
+  // Set by the tool unless given
+  size_t memory_high;
+};
+
+// Returns whether arg was one of --background, --max-rate=MiB, --max-files=N,
+// --cgroup or --memory-high=MiB. Exits if a number isn't one.
+bool ParseBackgroundArg(std::string_view arg, BackgroundOptions &options);
+
+#define BACKGROUND_USAGE                                                       \
+  "[--background] [--max-rate=MiB] [--max-files=N] [--cgroup "              \
+  "[--memory-high=MiB]]"
+
+// Applies to the calling thread and to the threads and children created later
+void EnterBackground(const BackgroundOptions &options);
+
+// Moves the process back to the cgroup it came from and removes the one
+// EnterBackground made once nothing is left in it. Runs at exit too.
+void LeaveBackground();
+
+// Token buckets for bytes and files plus a duty cycle that shrinks while
+// /proc/pressure shows others stalling. Threads share it, and one sleeping
+// holds back the others too.
+class Throttle {
+  using Clock = std::chrono::steady_clock;
+
+  std::mutex mutex_{};
+  BackgroundOptions options_{};
+  bool active_{};
+  Clock::time_point refilled_{};
+  double bytes_{}, files_{};
+  // Microseconds of IO and CPU stall on the host and of our own
+  struct Stalls {
+    unsigned long long all;
+    unsigned long long own;
+  };
+  std::string own_cgroup_{};
+  Clock::time_point checked_{};
+  Stalls stalls_{};
+  // Fraction of the time the build is allowed to run
+  double share_{1};
+  Clock::duration delay_{};
+
+  [[nodiscard]] Stalls ReadStalls() const;
+  [[nodiscard]] Clock::duration Backoff(Clock::time_point now);
+
+public:
+  void Start(const BackgroundOptions &options);
+
+  // Accounts for work just done and sleeps as long as the limits require
+  void Pace(size_t bytes, size_t files);
+
+  // Largest copy worth doing between two calls to Pace
+  [[nodiscard]] size_t Chunk() const;
+
+  [[nodiscard]] bool Active() const { return active_; }
+
+  // Time spent sleeping so far
+  [[nodiscard]] std::chrono::milliseconds Delay();
+};
@@ -0,0 +1,82 @@
+#define _GNU_SOURCE
+#include <elf.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Reports the size of an init binary and how long it takes from exec to
+// exiting on its quickest path, refusing to activate under another name. That
+// is all loader and libc startup, so it shows what PID 1 pays before main.
+
+static bool has_interpreter(int fd) {
+  Elf64_Ehdr ehdr;
+  if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+      ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+      ehdr.e_phentsize != sizeof(Elf64_Phdr))
+    abort();
+  for (unsigned int i = 0; i < ehdr.e_phnum; ++i) {
+    Elf64_Phdr phdr;
+    if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr)) !=
+        sizeof(phdr))
+      abort();
+    if (phdr.p_type == PT_INTERP)
+      return true;
+  }
+  return false;
+}
+
+static long run_once(const char *path, int null) {
+  struct timespec start, end;
+  if (clock_gettime(CLOCK_MONOTONIC, &start))
+    abort();
+  const pid_t pid = fork();
+  if (pid < 0)
+    abort();
+  if (!pid) {
+    if (dup2(null, 1) != 1 || dup2(null, 2) != 2)
+      abort();
+    execl(path, "tmpfs_switch_bench", "bench", NULL);
+    abort();
+  }
+  int wstatus;
+  if (waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus) ||
+      clock_gettime(CLOCK_MONOTONIC, &end))
+    abort();
+  return (end.tv_sec - start.tv_sec) * 1000000 +
+         (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+static int compare_long(const void *a, const void *b) {
+  const long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+  const char *const path = argc > 1 ? argv[1] : "./tmpfs_switch_init";
+  const unsigned int runs = argc > 2 ? atoi(argv[2]) : 200;
+  if (!runs || runs > 1000) {
+    puts("Usage: bench_init_startup [init] [runs]");
+    return 1;
+  }
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  const int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || null < 0 || fstat(fd, &st))
+    abort();
+  const bool dynamic = has_interpreter(fd);
+  if (close(fd))
+    abort();
+  long results[1000];
+  for (unsigned int i = 0; i < runs; ++i)
+    results[i] = run_once(path, null);
+  qsort(results, runs, sizeof(results[0]), compare_long);
+  printf("%s: %ld bytes, %s, exec to exit min %ld us median %ld us\n", path,
+         (long)st.st_size, dynamic ? "dynamic" : "static", results[0],
+         results[runs / 2]);
+  return 0;
+}
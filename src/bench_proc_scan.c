@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+#include "tmpfs_switch_init.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Drives scan_processes over a fake procfs of user processes and kernel
+// threads, without signalling anything
+
+static unsigned long victims;
+
+static void count_victim(pid_t pid, const char *name, bool term) {
+  (void)pid;
+  (void)name;
+  (void)term;
+  ++victims;
+}
+
+static void write_file(int dir, const char *path, const char *data,
+                       size_t len) {
+  const int fd =
+      openat(dir, path, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 || write(fd, data, len) != (ssize_t)len || close(fd))
+    abort();
+}
+
+static void populate(int procfs, unsigned int processes, bool remove) {
+  for (unsigned int pid = 2; pid < processes + 2; ++pid) {
+    // Every fourth entry is a kernel thread, like on a typical server
+    const bool kthread = !(pid % 4);
+    char path[32];
+    snprintf(path, sizeof(path), "%u/stat", pid);
+    if (remove) {
+      (void)unlinkat(procfs, path, 0);
+      snprintf(path, sizeof(path), "%u/cmdline", pid);
+      (void)unlinkat(procfs, path, 0);
+      snprintf(path, sizeof(path), "%u", pid);
+      (void)unlinkat(procfs, path, AT_REMOVEDIR);
+      continue;
+    }
+    char stat[128];
+    const int len = snprintf(
+        stat, sizeof(stat), "%u (%s) S %u %u %u 0 -1 %u 0 0 0 0\n", pid,
+        kthread ? "kworker/0:1" : "fake (daemon)", kthread ? 2 : 1, pid, pid,
+        kthread ? 0x00208040 : 0x00400100);
+    snprintf(path, sizeof(path), "%u", pid);
+    if (mkdirat(procfs, path, 0700))
+      abort();
+    snprintf(path, sizeof(path), "%u/stat", pid);
+    write_file(procfs, path, stat, len);
+    snprintf(path, sizeof(path), "%u/cmdline", pid);
+    static const char cmdline[] = "/usr/sbin/fake\0--daemon";
+    write_file(procfs, path, cmdline, sizeof(cmdline));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const unsigned int processes = argc > 1 ? atoi(argv[1]) : 4096;
+  const unsigned int iterations = argc > 2 ? atoi(argv[2]) : 100;
+  char root[] = "/tmp/bench_proc_scan.XXXXXX";
+  if (!mkdtemp(root))
+    abort();
+  const int procfs = open(root, O_CLOEXEC | O_DIRECTORY);
+  if (procfs < 0)
+    abort();
+  populate(procfs, processes, false);
+  struct timespec start, end;
+  if (clock_gettime(CLOCK_MONOTONIC, &start))
+    abort();
+  for (unsigned int i = 0; i < iterations; ++i)
+    scan_processes(procfs, true, count_victim);
+  if (clock_gettime(CLOCK_MONOTONIC, &end))
+    abort();
+  populate(procfs, processes, true);
+  if (close(procfs) || rmdir(root))
+    abort();
+  const double ns = (double)(end.tv_sec - start.tv_sec) * 1e9 +
+                    (double)(end.tv_nsec - start.tv_nsec);
+  fprintf(stderr, "%u entries, %lu victims per scan, %.0f ns per entry\n",
+          processes, victims / iterations,
+          ns / iterations / (processes ? processes : 1));
+  return 0;
+}
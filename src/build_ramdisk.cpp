@@ -1,20 +1,179 @@
+#include "background.h"
+#include "elf_strip.h"
 #include "work_file.h"
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <climits>
 #include <cstring>
+#include <elf.h>
+#include <ext/stdio_filebuf.h>
 #include <fcntl.h>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <linux/magic.h>
+#include <sstream>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/file.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
 
 #define INIT_BIN_NAME "tmpfs_switch_init"
+#define GATHER_BIN_NAME "gather_file_info"
+#define ZRAM_CONTROL "/sys/class/zram-control/hot_add"
+#define ZRAM_REMOVE "/sys/class/zram-control/hot_remove"
+// Entries and bytes copied between two journal checkpoints
+#define JOURNAL_INTERVAL 256
+#define JOURNAL_INTERVAL_BYTES (64ul << 20)
 
 using namespace std;
 
 namespace {
+struct Budget {
+  // Drop the source pages from the page cache once each file is copied
+  bool drop_cache;
+  size_t limit;
+  size_t used;
+  // Most memory the target itself took
+  size_t peak;
+} budget{
+    .drop_cache = false,
+    .limit = 1024ul << 20,
+    .used = 0,
+    .peak = 0,
+};
+
+struct Zram {
+  // Compressor to back the target with, or empty for a plain tmpfs
+  string algorithm;
+  int device;
+} zram{
+    .algorithm{},
+    .device = -1,
+};
+
+struct Strip {
+  // Drop debug info and symbols from ELF files on the way in
+  bool enabled;
+  unsigned long files;
+  size_t saved;
+} strip{
+    .enabled = false,
+    .files = 0,
+    .saved = 0,
+};
+
+struct Skip {
+  // Leave out entries that can't be copied instead of stopping
+  bool keep_going;
+  unsigned long count;
+} skip{
+    .keep_going = false,
+    .count = 0,
+};
+
+// Checkpoints kept in the target so an interrupted build can carry on. Every
+// entry before a checkpoint is in place, those after it may be partly there.
+struct Journal {
+  int fd;
+  // Entries past the last checkpoint may already exist and get replaced
+  bool resumed;
+  // BOM bytes handled so far and their FNV-1a hash
+  unsigned long offset;
+  uint64_t hash;
+  unsigned long pending;
+  size_t checkpoint_used;
+} journal{
+    .fd = -1,
+    .resumed = false,
+    .offset = 0,
+    .hash = 14695981039346656037ull,
+    .pending = 0,
+    .checkpoint_used = 0,
+};
+
+// The data section of the BOM, mapped
+struct Payloads {
+  const char *data;
+  size_t size;
+  // Where the entries end and the data section line begins
+  streamoff entries_end;
+} payloads{
+    .data = nullptr,
+    .size = 0,
+    .entries_end = 0,
+};
+
+BackgroundOptions background{};
+Throttle throttle{};
+
+const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+// What the target holds in memory, unlike MemAvailable which moves with
+// everything else on the host
+size_t TargetUsage() {
+  if (zram.device >= 0) {
+    ifstream mm_stat{"/sys/block/zram" + to_string(zram.device) + "/mm_stat"};
+    size_t orig{}, compr{}, total{}, limit{}, total_max{};
+    return mm_stat >> orig >> compr >> total >> limit >> total_max ? total_max
+                                                                   : 0;
+  }
+  struct statfs st {};
+  if (statfs(TARGET_DIR, &st) || st.f_type != TMPFS_MAGIC)
+    return 0;
+  return (st.f_blocks - st.f_bfree) * st.f_bsize;
+}
+
+void SampleMemory() { budget.peak = max(budget.peak, TargetUsage()); }
+
+void Report() {
+  // Only what has been written back reaches zram
+  if (zram.device >= 0) {
+    const int target = open(TARGET_DIR, O_RDONLY | O_CLOEXEC | O_DIRECTORY);
+    if (target < 0 || syncfs(target) || close(target))
+      abort();
+  }
+  SampleMemory();
+  struct rusage usage {};
+  if (getrusage(RUSAGE_SELF, &usage))
+    abort();
+  cout << "Copied " << (budget.used >> 20) << " MiB of " << (budget.limit >> 20)
+       << " MiB budget, peak memory use " << (budget.peak >> 20)
+       << " MiB, peak RSS " << (usage.ru_maxrss >> 10) << " MiB in "
+       << chrono::duration_cast<chrono::milliseconds>(
+              chrono::steady_clock::now() - start)
+              .count()
+       << " ms" << endl;
+  if (throttle.Active())
+    cout << "Throttling held the build back " << throttle.Delay().count()
+         << " ms" << endl;
+  if (skip.count)
+    cout << "Skipped " << skip.count << " entries, listed in "
+         << SKIPPED_FILE_NAME << endl;
+  if (strip.enabled)
+    cout << "Stripped " << strip.files << " ELF files, saving "
+         << (strip.saved >> 10) << " KiB" << endl;
+  if (zram.device < 0)
+    return;
+  ifstream mm_stat{"/sys/block/zram" + to_string(zram.device) + "/mm_stat"};
+  size_t orig{}, compr{}, total{};
+  if (!(mm_stat >> orig >> compr >> total))
+    abort();
+  cout << "zram " << zram.algorithm << " holds " << (orig >> 20)
+       << " MiB in " << (compr >> 20) << " MiB, ratio "
+       << setprecision(3)
+       << (compr ? static_cast<double>(orig) / static_cast<double>(compr) : 0)
+       << ", " << (total >> 20) << " MiB used" << endl;
+}
+
 void AssertEmptyDir(const char *path) {
   if (path[0] != '/' || strchr(path + 1, '/'))
     abort();
@@ -32,12 +191,283 @@ void AssertEmptyDir(const char *path) {
 
 int Mount() {
   AssertEmptyDir(TARGET_DIR);
+  const string options{"size=" + to_string(budget.limit >> 10) + "k,mode=700"};
   if (mount("none", TARGET_DIR, "tmpfs", MS_NODEV | MS_NOSUID | MS_NOATIME,
-            "size=1048576k,mode=700"))
+            options.c_str()))
+    abort();
+  const int dir = open(TARGET_DIR, O_CLOEXEC | O_DIRECTORY | O_PATH);
+  if (dir < 0)
+    abort();
+  return dir;
+}
+
+// Maps the data section, if gather_file_info --inline wrote one
+void MapPayloads() {
+  const int fd = open(WORK_FILE_NAME, O_RDONLY | O_CLOEXEC);
+  struct stat st {};
+  if (fd < 0 || fstat(fd, &st))
+    abort();
+  if (st.st_size) {
+    void *const map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+      abort();
+    const char *const bom = static_cast<const char *>(map);
+    static constexpr char LINE[]{'\n', DATA_SECTION, '\n'};
+    const char *const section =
+        static_cast<const char *>(memmem(bom, st.st_size, LINE, sizeof(LINE)));
+    if (section) {
+      payloads.data = section + sizeof(LINE);
+      payloads.size = bom + st.st_size - payloads.data;
+      payloads.entries_end = section + 1 - bom;
+    } else if (munmap(map, st.st_size)) {
+      abort();
+    }
+  }
+  if (close(fd))
+    abort();
+}
+
+// Finds an inlined entry's contents in the data section and returns its path
+const char *InlinePayload(const char *desc, string_view &payload) {
+  char *end;
+  const unsigned long offset = strtoul(desc + 1, &end, 10);
+  if (*end != ' ')
+    abort();
+  const unsigned long size = strtoul(end + 1, &end, 10);
+  if (*end != '/' || !payloads.data || offset > payloads.size ||
+      payloads.size - offset < size)
+    abort();
+  payload = {payloads.data + offset, size};
+  return end;
+}
+
+// Estimates the space and inodes the BOM needs on a filesystem with 4K blocks
+void MeasureBom(ifstream &f, size_t &bytes, size_t &inodes) {
+  bytes = inodes = 0;
+  string l{};
+  while (getline(f, l)) {
+    if (l.size() == 1 && l[0] == DATA_SECTION)
+      break;
+    if (l[0] == COPY_EXE_INLINE || l[0] == COPY_DAT_INLINE) {
+      string_view payload{};
+      static_cast<void>(InlinePayload(l.c_str(), payload));
+      ++inodes;
+      bytes += (payload.size() + 4095) & ~size_t{4095};
+      continue;
+    }
+    struct stat st {};
+    throttle.Pace(0, 1);
+    if (l.size() < 2 || lstat(l.c_str() + 1, &st))
+      continue;
+    ++inodes;
+    if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))
+      bytes += (static_cast<size_t>(st.st_size) + 4095) & ~size_t{4095};
+  }
+  f.clear();
+  f.seekg(0);
+}
+
+bool WriteSysfs(const string &path, const string &value) {
+  const int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    abort();
+  if (write(fd, value.data(), value.size()) !=
+      static_cast<ssize_t>(value.size())) {
+    cout << "Writing " << value << " to " << path << " failed " << errno
+         << endl;
+    static_cast<void>(close(fd));
+    return false;
+  }
+  if (close(fd))
+    abort();
+  return true;
+}
+
+// Gives back the device MountZram added before stopping, as each failed run
+// would leak one otherwise
+[[noreturn]] void AbortZram(const char *what, bool mounted) {
+  cout << what << " failed " << errno << ", removing zram" << zram.device
+       << endl;
+  if (mounted)
+    static_cast<void>(umount(TARGET_DIR));
+  static_cast<void>(WriteSysfs(
+      "/sys/block/zram" + to_string(zram.device) + "/reset", "1"));
+  static_cast<void>(WriteSysfs(ZRAM_REMOVE, to_string(zram.device)));
+  abort();
+}
+
+// Same as Mount, but with the files compressed on a zram device
+int MountZram(ifstream &f) {
+  AssertEmptyDir(TARGET_DIR);
+  size_t bytes, inodes;
+  MeasureBom(f, bytes, inodes);
+  // Room for the usrmerge skeleton, init and ext2's own metadata
+  inodes += 1024;
+  bytes += bytes / 16 + inodes * 256 + (64ul << 20);
+  {
+    ifstream hot_add{ZRAM_CONTROL};
+    if (!(hot_add >> zram.device))
+      abort();
+  }
+  const string sysfs{"/sys/block/zram" + to_string(zram.device) + '/'};
+  // The budget caps the compressed size instead
+  if (!WriteSysfs(sysfs + "comp_algorithm", zram.algorithm) ||
+      !WriteSysfs(sysfs + "disksize", to_string(bytes)) ||
+      !WriteSysfs(sysfs + "mem_limit", to_string(budget.limit)))
+    AbortZram("Configuring zram", false);
+  const string device{"/dev/zram" + to_string(zram.device)};
+  const pid_t pid = fork();
+  if (pid < 0)
+    AbortZram("fork", false);
+  if (!pid) {
+    const string inodes_arg{to_string(inodes)};
+    execl("/sbin/mkfs.ext2", "mkfs.ext2", "-q", "-m", "0", "-b", "4096", "-N",
+          inodes_arg.c_str(), device.c_str(), nullptr);
     abort();
+  }
+  int wstatus;
+  if (waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus) ||
+      WEXITSTATUS(wstatus))
+    AbortZram("mkfs.ext2", false);
+  if (mount(device.c_str(), TARGET_DIR, "ext2",
+            MS_NODEV | MS_NOSUID | MS_NOATIME, nullptr))
+    AbortZram("Mounting zram", false);
+  if (chmod(TARGET_DIR, 0700))
+    AbortZram("chmod", true);
   const int dir = open(TARGET_DIR, O_CLOEXEC | O_DIRECTORY | O_PATH);
   if (dir < 0)
+    AbortZram("Opening " TARGET_DIR, true);
+  if (unlinkat(dir, "lost+found", AT_REMOVEDIR)) {
+    static_cast<void>(close(dir));
+    AbortZram("Removing lost+found", true);
+  }
+  return dir;
+}
+
+void JournalLine(const string &l) {
+  for (const char c : l)
+    journal.hash = (journal.hash ^ static_cast<unsigned char>(c)) *
+                   1099511628211ull;
+  journal.hash = (journal.hash ^ '\n') * 1099511628211ull;
+  journal.offset += l.size() + 1;
+  ++journal.pending;
+}
+
+void Checkpoint(bool force) {
+  if (journal.fd < 0 || !journal.pending ||
+      (!force && journal.pending < JOURNAL_INTERVAL &&
+       budget.used - journal.checkpoint_used < JOURNAL_INTERVAL_BYTES))
+    return;
+  char record[128];
+  const int len = snprintf(record, sizeof(record), "%lu %016lx %zu %lu %zu\n",
+                           journal.offset, journal.hash, budget.used,
+                           strip.files, strip.saved);
+  if (write(journal.fd, record, len) != len)
     abort();
+  journal.pending = 0;
+  journal.checkpoint_used = budget.used;
+}
+
+// The lock is inherited by the bulk tier's process, so a resume can't race it
+void LockJournal() {
+  if (flock(journal.fd, LOCK_EX | LOCK_NB)) {
+    cout << "Another build_ramdisk is still working on " TARGET_DIR << endl;
+    exit(1);
+  }
+}
+
+void StartJournal(int dir) {
+  journal.fd = openat(dir, JOURNAL_FILE,
+                      O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL | O_APPEND, 0600);
+  if (journal.fd < 0)
+    abort();
+  LockJournal();
+  const string header{zram.algorithm.empty()
+                          ? "tmpfs\n"
+                          : "zram " + to_string(zram.device) + ' ' +
+                                zram.algorithm + '\n'};
+  if (write(journal.fd, header.data(), header.size()) !=
+      static_cast<ssize_t>(header.size()))
+    abort();
+  static_cast<void>(unlink(SKIPPED_FILE_NAME));
+}
+
+// Picks up the target of an interrupted build. Only the last complete
+// checkpoint counts, and the BOM must still hash the same up to it.
+int Resume(ifstream &f, bool budget_given, bool &past_tier) {
+  const int dir = open(TARGET_DIR, O_CLOEXEC | O_DIRECTORY | O_PATH);
+  if (dir < 0)
+    abort();
+  journal.fd = openat(dir, JOURNAL_FILE, O_RDWR | O_CLOEXEC | O_APPEND);
+  if (journal.fd < 0) {
+    cout << "No build to resume in " TARGET_DIR << endl;
+    exit(1);
+  }
+  LockJournal();
+  if (!faccessat(dir, READY_MARKER, F_OK, 0)) {
+    cout << "The build in " TARGET_DIR " is already complete" << endl;
+    exit(0);
+  }
+  unsigned long offset{}, files{};
+  uint64_t hash{journal.hash};
+  size_t used{}, saved{}, complete{};
+  {
+    ifstream j{TARGET_DIR "/" JOURNAL_FILE};
+    string l{};
+    if (!getline(j, l) || j.eof())
+      abort();
+    complete = l.size() + 1;
+    if (l.starts_with("zram ")) {
+      istringstream header{l.substr("zram "sv.size())};
+      if (!(header >> zram.device >> zram.algorithm))
+        abort();
+    } else if (l != "tmpfs") {
+      abort();
+    }
+    // A torn write leaves the last line without its newline
+    while (getline(j, l) && !j.eof()) {
+      if (sscanf(l.c_str(), "%lu %lx %zu %lu %zu", &offset, &hash, &used,
+                 &files, &saved) != 5)
+        abort();
+      complete += l.size() + 1;
+    }
+  }
+  // New checkpoints must not be appended to the torn one
+  if (ftruncate(journal.fd, static_cast<off_t>(complete)))
+    abort();
+  string l{};
+  while (journal.offset < offset && getline(f, l)) {
+    past_tier |= l.size() == 1 && l[0] == TIER_BULK;
+    JournalLine(l);
+  }
+  if (journal.offset != offset || journal.hash != hash) {
+    cout << "The journal in " TARGET_DIR " doesn't match " WORK_FILE_NAME
+         << ", unmount it and start over" << endl;
+    exit(1);
+  }
+  journal.pending = 0;
+  journal.resumed = true;
+  budget.used = journal.checkpoint_used = used;
+  strip.files = files;
+  strip.saved = saved;
+  if (zram.device < 0) {
+    if (budget_given &&
+        mount(nullptr, TARGET_DIR, nullptr,
+              MS_REMOUNT | MS_NODEV | MS_NOSUID | MS_NOATIME,
+              ("size=" + to_string(budget.limit >> 10) + "k").c_str()))
+      abort();
+    struct statfs st {};
+    if (statfs(TARGET_DIR, &st))
+      abort();
+    budget.limit = st.f_blocks * st.f_bsize;
+  } else if (budget_given &&
+             !WriteSysfs("/sys/block/zram" + to_string(zram.device) +
+                             "/mem_limit",
+                         to_string(budget.limit))) {
+    abort();
+  }
+  cout << "Resuming after " << (used >> 20) << " MiB at " WORK_FILE_NAME
+       << " offset " << offset << endl;
   return dir;
 }
 
@@ -61,7 +491,85 @@ void UsrMerge(int dir) {
   }
 }
 
-void SendFileImpl(int output, int input, bool exe) {
+void Charge(size_t bytes) {
+  budget.used += bytes;
+  if (zram.algorithm.empty() && budget.used > budget.limit) {
+    cout << "Memory budget of " << (budget.limit >> 20) << " MiB exceeded"
+         << endl;
+    abort();
+  }
+}
+
+// Leaves an entry out of the ramdisk, or stops if that isn't allowed
+void Skip(const char *path, const char *what, int error = 0) {
+  cout << "Cannot copy " << path << ": " << what;
+  if (error)
+    cout << ' ' << error;
+  cout << endl;
+  if (!skip.keep_going)
+    abort();
+  ofstream skipped{SKIPPED_FILE_NAME, ios::app};
+  skipped << path << '\t' << what;
+  if (error)
+    skipped << ' ' << error;
+  skipped << '\n';
+  if (!skipped.flush())
+    abort();
+  ++skip.count;
+}
+
+// Only a parent left out before excuses a failure to create in the target
+void CheckCreate(const char *path, const char *what) {
+  if (errno != ENOENT) {
+    cout << what << ' ' << path << " failed " << errno << endl;
+    abort();
+  }
+  Skip(path, "parent missing");
+}
+
+void WriteAll(int output, string_view data) {
+  for (size_t done = 0; done < data.size();) {
+    const ssize_t ret = write(output, data.data() + done, data.size() - done);
+    if (ret <= 0)
+      abort();
+    done += ret;
+  }
+}
+
+// Writes a stripped copy of an ELF image, or returns false to copy it as is
+bool WriteStripped(int output, string_view input) {
+  if (input.size() < EI_NIDENT || memcmp(input.data(), ELFMAG, SELFMAG))
+    return false;
+  const vector<char> image{StripElf(input)};
+  if (image.empty())
+    return false;
+  Charge(image.size());
+  WriteAll(output, {image.data(), image.size()});
+  ++strip.files;
+  strip.saved += input.size() - image.size();
+  return true;
+}
+
+// Same for a file, checking the magic before mapping it
+bool SendStripped(int output, int input, size_t size) {
+  char magic[SELFMAG];
+  if (size < EI_NIDENT || pread(input, magic, SELFMAG, 0) != SELFMAG ||
+      memcmp(magic, ELFMAG, SELFMAG))
+    return false;
+  void *const map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, input, 0);
+  if (map == MAP_FAILED)
+    abort();
+  const bool stripped =
+      WriteStripped(output, {static_cast<const char *>(map), size});
+  if (munmap(map, size))
+    abort();
+  if (stripped)
+    throttle.Pace(size, 0);
+  return stripped;
+}
+
+// Returns why the input couldn't be copied, or nullptr
+[[nodiscard]] const char *SendFileData(int output, int input, bool exe) {
   ssize_t rem;
   {
     struct stat st {};
@@ -69,25 +577,59 @@ void SendFileImpl(int output, int input, bool exe) {
       abort();
     rem = st.st_size;
     if (rem < 0 || rem > 134217728) // 128MiB
-      abort();
+      return "too large";
     if (!rem && exe)
-      abort();
+      return "empty executable";
   }
+  if (strip.enabled && SendStripped(output, input, rem))
+    rem = 0;
+  else
+    Charge(rem);
   if (rem) {
     ssize_t ret{};
     do {
       rem -= ret;
-      ret = sendfile(output, input, nullptr, rem);
+      ret = sendfile(output, input, nullptr,
+                     min(static_cast<size_t>(rem), throttle.Chunk()));
       if (ret < 0) {
-        cout << errno << endl;
-        abort();
+        const int error = errno;
+        cout << error << endl;
+        // The target filling up is not the entry's fault
+        if (error == ENOSPC || error == EDQUOT || error == EFBIG)
+          abort();
+        return "read failed";
       }
+      throttle.Pace(ret, 0);
     } while (ret && ret < rem);
     if (ret != rem)
-      abort();
+      return "changed while copying";
   }
+  return nullptr;
+}
+
+[[nodiscard]] const char *SendFileImpl(int output, int input, bool exe) {
+  const char *const failure = SendFileData(output, input, exe);
+  if (!failure && budget.drop_cache &&
+      posix_fadvise(input, 0, 0, POSIX_FADV_DONTNEED))
+    abort();
   if (close(output) || close(input))
     abort();
+  return failure;
+}
+
+// Returns the new file in the target, or -1 if it was skipped
+int Create(int dir, const char *path, bool exe) {
+  const auto create = [dir, path, exe] {
+    return openat(dir, path + 1, O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL,
+                  exe ? 0700 : 0600);
+  };
+  int output = create();
+  if (output < 0 && errno == EEXIST && journal.resumed &&
+      !unlinkat(dir, path + 1, 0))
+    output = create();
+  if (output < 0)
+    CheckCreate(path, "create");
+  return output;
 }
 
 void SendFile(int dir, const char *desc) {
@@ -97,37 +639,63 @@ void SendFile(int dir, const char *desc) {
   case COPY_EXE:
   case COPY_DAT: {
     const int input = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
-    if (input < 0)
-      abort();
-    const int output =
-        openat(dir, path + 1, O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL,
-               type == COPY_EXE ? 0700 : 0600);
+    if (input < 0) {
+      Skip(path, "open failed", errno);
+      break;
+    }
+    const int output = Create(dir, path, type == COPY_EXE);
+    if (output < 0) {
+      if (close(input))
+        abort();
+      break;
+    }
+    if (const char *failure = SendFileImpl(output, input, type == COPY_EXE)) {
+      if (unlinkat(dir, path + 1, 0))
+        abort();
+      Skip(path, failure);
+    }
+    break;
+  }
+  // Never touches the source
+  case COPY_EXE_INLINE:
+  case COPY_DAT_INLINE: {
+    string_view payload{};
+    path = InlinePayload(desc, payload);
+    const int output = Create(dir, path, type == COPY_EXE_INLINE);
     if (output < 0)
+      break;
+    if (!strip.enabled || !WriteStripped(output, payload)) {
+      Charge(payload.size());
+      WriteAll(output, payload);
+    }
+    if (close(output))
       abort();
-    SendFileImpl(output, input, type == COPY_EXE);
     break;
   }
   case COPY_DIR:
     if (mkdirat(dir, path + 1, 0700) && errno != EEXIST)
-      abort();
+      CheckCreate(path, "mkdir");
     break;
   case COPY_LNK: {
     static constexpr size_t MAX_LINK_SIZE = 255;
     static_assert(MAX_LINK_SIZE < PATH_MAX);
     char buffer[MAX_LINK_SIZE];
     const ssize_t lnk_size = readlink(path, buffer, MAX_LINK_SIZE);
-    if (lnk_size <= 0 || lnk_size == MAX_LINK_SIZE)
-      abort();
+    if (lnk_size <= 0 || lnk_size == MAX_LINK_SIZE) {
+      Skip(path, lnk_size < 0 ? "readlink failed" : "link too long",
+           lnk_size < 0 ? errno : 0);
+      break;
+    }
     char existing[MAX_LINK_SIZE];
     const ssize_t original_size =
         readlinkat(dir, path + 1, existing, MAX_LINK_SIZE);
     if (original_size >= 0) {
       if (original_size != lnk_size || !!memcmp(buffer, existing, lnk_size))
-        abort();
+        Skip(path, "conflicting link");
     } else {
       buffer[lnk_size] = '\0';
       if (symlinkat(buffer, dir, path + 1))
-        abort();
+        CheckCreate(path, "symlink");
     }
     break;
   }
@@ -136,59 +704,342 @@ void SendFile(int dir, const char *desc) {
   }
 }
 
-[[maybe_unused]] void SendFiles(int dir, ifstream f) {
+void Mark(int dir, const char *name) {
+  const int fd =
+      openat(dir, name, O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 || close(fd))
+    abort();
+}
+
+// Held locked by whoever copies the bulk tier, so activate can tell a copy
+// still going from one that died
+int OpenProgress(int dir) {
+  const int progress = openat(dir, PROGRESS_FILE,
+                              O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0600);
+  if (progress < 0 || flock(progress, LOCK_EX))
+    abort();
+  return progress;
+}
+
+void Progress(int progress, streamoff done, streamoff total) {
+  char buf[8];
+  const int len = snprintf(buf, sizeof(buf), "%3d%%\n",
+                           total ? static_cast<int>(done * 100 / total) : 100);
+  if (pwrite(progress, buf, len, 0) != len)
+    abort();
+}
+
+// Returns whether the line ends the critical tier
+bool SendLine(int dir, const string &l, bool bulk) {
+  if (l.size() == 1 && l[0] == TIER_BULK)
+    return true;
+  // Inlined entries have digits before the path
+  const char *const path = strchr(l.c_str(), '/');
+  if (!path || path[1] == '/')
+    abort();
+  // Already replaced by SendInit before the bulk tier
+  if (bulk && path == "/sbin/init"sv)
+    return false;
+  throttle.Pace(0, 1);
+  SendFile(dir, l.c_str());
+  return false;
+}
+
+// Returns whether the critical tier ended and a bulk tier follows
+bool SendFiles(int dir, ifstream &f, int progress = -1) {
+  streamoff begin{}, total{};
+  if (progress >= 0) {
+    begin = f.tellg();
+    f.seekg(0, ios::end);
+    total = (payloads.data ? payloads.entries_end : streamoff{f.tellg()}) - begin;
+    f.seekg(begin);
+  }
   string l{};
   l.reserve(100);
-  while (getline(f, l)) {
-    if (l.empty())
-      continue;
-    if (l[1] != '/' || l[2] == '/')
+  for (unsigned long i{}; getline(f, l); ++i) {
+    if (l.size() == 1 && l[0] == DATA_SECTION)
+      break;
+    // The tier break is journaled once init is in place
+    if (!l.empty() && SendLine(dir, l, progress >= 0))
+      return true;
+    JournalLine(l);
+    Checkpoint(false);
+    if (!(i % 1024)) {
+      SampleMemory();
+      if (progress >= 0)
+        Progress(progress, f.tellg() - begin, total);
+    }
+  }
+  Checkpoint(true);
+  if (progress >= 0)
+    Progress(progress, total, total);
+  return false;
+}
+
+void SendBulk(int dir, ifstream &f, int progress) {
+  const pid_t pid = fork();
+  if (pid < 0)
+    abort();
+  if (pid) {
+    // The lock stays with the child
+    if (close(progress))
       abort();
-    SendFile(dir, l.c_str());
+    cout << "Critical tier ready, copying the rest in the background as pid "
+         << pid << endl;
+    return;
   }
+  if (setsid() < 0)
+    abort();
+  if (SendFiles(dir, f, progress))
+    abort();
+  // The lock only goes once the marker is there to be found
+  Mark(dir, READY_MARKER);
+  if (close(progress))
+    abort();
+  Report();
+  // _exit skips the atexit handlers
+  LeaveBackground();
+  _exit(0);
 }
 
 void SendInit(int fd, int dir) {
-  static_cast<void>(unlinkat(dir, "sbin/init", 0));
+  // The BOM's own /sbin/init, or what an interrupted build left
+  for (const char *name : {"sbin/init", "activate", "return", "record",
+                           "sbin/tmpfs_switch_init"})
+    static_cast<void>(unlinkat(dir, name, 0));
   if (symlinkat("tmpfs_switch_init", dir, "sbin/init") ||
-      symlinkat("sbin/tmpfs_switch_init", dir, "activate"))
+      symlinkat("sbin/tmpfs_switch_init", dir, "activate") ||
+      symlinkat("sbin/tmpfs_switch_init", dir, "return") ||
+      symlinkat("sbin/tmpfs_switch_init", dir, "record"))
     abort();
   const int output = openat(dir, "sbin/tmpfs_switch_init",
                             O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL, 0700);
   // sendfile does not work in a virtualbox shared folder as of 6.1.38. Oh well.
-  SendFileImpl(output, fd, true);
+  if (output < 0 || SendFileImpl(output, fd, true))
+    abort();
 }
 
-void Run() {
+void Run(bool resume, bool budget_given) {
   ifstream f{WORK_FILE_NAME};
   if (!f)
     abort();
+  const int init =
+      open(INIT_BIN_NAME, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (init < 0)
+    abort();
+  MapPayloads();
+  bool past_tier = false;
+  int dir;
+  if (resume) {
+    dir = Resume(f, budget_given, past_tier);
+  } else {
+    dir = zram.algorithm.empty() ? Mount() : MountZram(f);
+    UsrMerge(dir);
+    StartJournal(dir);
+  }
+  const bool bulk = past_tier || SendFiles(dir, f);
+  const int progress = bulk ? OpenProgress(dir) : -1;
+  if (!past_tier) {
+    SendInit(init, dir);
+    Mark(dir, CRITICAL_MARKER);
+    if (bulk) {
+      JournalLine(string(1, TIER_BULK));
+      Checkpoint(true);
+    }
+  }
+  if (bulk)
+    SendBulk(dir, f, progress);
+  else
+    Mark(dir, READY_MARKER);
+  if (close(dir))
+    abort();
+  Report();
+}
+
+// Single producer single consumer ring of BOM lines. An empty line marks the
+// end. Strings are swapped in and out so their buffers get reused.
+class LineQueue {
+  static constexpr uint32_t SIZE = 1024;
+  array<string, SIZE> slots{};
+  atomic<uint32_t> head{}, tail{};
+
+public:
+  void Push(string &line) {
+    const uint32_t t = tail.load(memory_order_relaxed);
+    for (uint32_t h; t - (h = head.load(memory_order_acquire)) == SIZE;)
+      head.wait(h, memory_order_acquire);
+    slots[t % SIZE].swap(line);
+    tail.store(t + 1, memory_order_release);
+    tail.notify_one();
+  }
+
+  void Pop(string &line) {
+    const uint32_t h = head.load(memory_order_relaxed);
+    for (uint32_t t; (t = tail.load(memory_order_acquire)) == h;)
+      tail.wait(t, memory_order_acquire);
+    slots[h % SIZE].swap(line);
+    head.store(h + 1, memory_order_release);
+    head.notify_one();
+  }
+};
+
+pid_t SpawnGather(int &output) {
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC))
+    abort();
+  const pid_t pid = fork();
+  if (pid < 0)
+    abort();
+  if (!pid) {
+    if (dup2(pipefd[1], 1) != 1)
+      abort();
+    execl("./" GATHER_BIN_NAME, GATHER_BIN_NAME, "--stream", nullptr);
+    abort();
+  }
+  if (close(pipefd[1]))
+    abort();
+  output = pipefd[0];
+  return pid;
+}
+
+// Copies entries as gather_file_info streams them instead of waiting for the
+// whole BOM. Runs in the foreground as threads don't survive a fork. There is
+// no journal: a resume replays the BOM file, which gather only writes once
+// the stream is over, so an interrupted pipeline has to start over.
+void RunPipeline() {
   const int init =
       open(INIT_BIN_NAME, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
   if (init < 0)
     abort();
   const int dir = Mount();
   UsrMerge(dir);
-  SendFiles(dir, std::move(f));
-  SendInit(init, dir);
-  if (close(dir))
+  int output;
+  const pid_t gather = SpawnGather(output);
+  LineQueue queue{};
+  jthread reader{[&queue, output] {
+    __gnu_cxx::stdio_filebuf<char> p{output, ios::in};
+    istream is{&p};
+    string l{};
+    while (getline(is, l)) {
+      if (!l.empty())
+        queue.Push(l);
+    }
+    l.clear();
+    queue.Push(l);
+  }};
+  string l{};
+  bool bulk = false;
+  int progress = -1;
+  for (unsigned long i{};; ++i) {
+    queue.Pop(l);
+    if (l.empty())
+      break;
+    if (SendLine(dir, l, bulk)) {
+      if (bulk)
+        abort();
+      bulk = true;
+      // No total to show a percentage of, just the lock
+      progress = OpenProgress(dir);
+      SendInit(init, dir);
+      Mark(dir, CRITICAL_MARKER);
+      cout << "Critical tier ready, copying the rest as it is gathered" << endl;
+    }
+    if (!(i % 1024))
+      SampleMemory();
+  }
+  reader.join();
+  int wstatus;
+  if (waitpid(gather, &wstatus, 0) != gather || !WIFEXITED(wstatus) ||
+      WEXITSTATUS(wstatus) || !bulk)
     abort();
+  Mark(dir, READY_MARKER);
+  if (close(progress) || close(dir))
+    abort();
+  Report();
 }
 } // namespace
 
-int main() {
+int main(int argc, char *argv[]) {
+  bool pipeline = false, resume = false, budget_given = false;
+  for (int i = 1; i < argc; ++i) {
+    const string_view arg{argv[i]};
+    if (ParseBackgroundArg(arg, background))
+      continue;
+    if (arg == "--drop-cache") {
+      budget.drop_cache = true;
+    } else if (arg == "--strip") {
+      strip.enabled = true;
+    } else if (arg == "--pipeline") {
+      pipeline = true;
+    } else if (arg == "--resume") {
+      resume = true;
+    } else if (arg == "--keep-going") {
+      skip.keep_going = true;
+    } else if (arg.starts_with("--zram=")) {
+      zram.algorithm = arg.substr("--zram="sv.size());
+    } else if (arg.starts_with("--budget=")) {
+      const char *const value = argv[i] + "--budget="sv.size();
+      char *end;
+      errno = 0;
+      const unsigned long mib = strtoul(value, &end, 10);
+      // strtoul would also take a sign, spaces and a unit it ignores
+      if (value[0] < '0' || value[0] > '9' || *end || errno || !mib ||
+          mib > SIZE_MAX >> 20) {
+        puts("--budget takes a positive whole number of MiB");
+        return 1;
+      }
+      budget.limit = mib << 20;
+      budget_given = true;
+    } else {
+      puts("Usage: build_ramdisk [--drop-cache] [--strip] [--keep-going] "
+           "[--budget=MiB] " BACKGROUND_USAGE " "
+           "[--pipeline | --zram=lz4|lzo|zstd|... | --resume]");
+      return 1;
+    }
+  }
+  if (pipeline && !zram.algorithm.empty()) {
+    puts("zram is sized from the whole BOM, so it can't be pipelined");
+    return 1;
+  }
+  if (resume && pipeline) {
+    puts("A pipelined build keeps no journal, so it can't be resumed");
+    return 1;
+  }
+  if (resume && !zram.algorithm.empty()) {
+    puts("A resumed build carries on with the backend it started with");
+    return 1;
+  }
   if (getuid()) {
     puts("Root is required to build the ramdisk");
     return 1;
   }
-  if (!filesystem::is_regular_file(WORK_FILE_NAME)) {
-    puts("Please run ./gather_file_info first");
+  if (pipeline ? !filesystem::is_regular_file(GATHER_BIN_NAME)
+               : !filesystem::is_regular_file(WORK_FILE_NAME)) {
+    puts(pipeline ? "./" GATHER_BIN_NAME " is missing"
+                  : "Please run ./gather_file_info first");
     return 1;
   }
   if (!filesystem::is_regular_file(INIT_BIN_NAME)) {
     puts("./" INIT_BIN_NAME " is missing");
     return 1;
   }
-  Run();
+  if (!zram.algorithm.empty() && !filesystem::exists(ZRAM_CONTROL)) {
+    puts("zram is unavailable, try modprobe zram");
+    return 1;
+  }
+  if (!resume && filesystem::exists(TARGET_DIR "/" JOURNAL_FILE)) {
+    puts("An interrupted build is in " TARGET_DIR
+         ", continue it with --resume or unmount it");
+    return 1;
+  }
+  // The ramdisk's own pages are charged too, so leave room above them
+  if (!background.memory_high)
+    background.memory_high = budget.limit + (256ul << 20);
+  EnterBackground(background);
+  throttle.Start(background);
+  if (pipeline)
+    RunPipeline();
+  else
+    Run(resume, budget_given);
   return 0;
 }
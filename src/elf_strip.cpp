@@ -0,0 +1,215 @@
+#include "elf_strip.h"
+#include <algorithm>
+#include <cstring>
+#include <elf.h>
+#include <string_view>
+
+using namespace std;
+
+namespace {
+struct Elf32 {
+  using Ehdr = Elf32_Ehdr;
+  using Phdr = Elf32_Phdr;
+  using Shdr = Elf32_Shdr;
+  static constexpr unsigned char CLASS = ELFCLASS32;
+};
+
+struct Elf64 {
+  using Ehdr = Elf64_Ehdr;
+  using Phdr = Elf64_Phdr;
+  using Shdr = Elf64_Shdr;
+  static constexpr unsigned char CLASS = ELFCLASS64;
+};
+
+constexpr unsigned char NATIVE_DATA =
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? ELFDATA2LSB : ELFDATA2MSB;
+
+template <typename T>
+bool Read(span<const char> image, size_t offset, T &out) {
+  if (offset > image.size() || image.size() - offset < sizeof(T))
+    return false;
+  memcpy(&out, image.data() + offset, sizeof(T));
+  return true;
+}
+
+bool InBounds(span<const char> image, size_t offset, size_t size) {
+  return offset <= image.size() && image.size() - offset >= size;
+}
+
+template <typename E> struct Parsed {
+  typename E::Ehdr ehdr;
+  vector<typename E::Phdr> phdrs;
+  vector<typename E::Shdr> shdrs;
+  string_view shstrtab;
+
+  [[nodiscard]] string_view Name(const typename E::Shdr &sh) const {
+    return shstrtab.data() + sh.sh_name;
+  }
+};
+
+template <typename E> bool Parse(span<const char> image, Parsed<E> &elf) {
+  using Phdr = typename E::Phdr;
+  using Shdr = typename E::Shdr;
+  const auto &ehdr = elf.ehdr;
+  if (!Read(image, 0, elf.ehdr) || ehdr.e_ident[EI_CLASS] != E::CLASS ||
+      ehdr.e_ident[EI_DATA] != NATIVE_DATA ||
+      (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN) ||
+      ehdr.e_phentsize != sizeof(Phdr) || ehdr.e_shentsize != sizeof(Shdr) ||
+      !ehdr.e_shoff || ehdr.e_shstrndx == SHN_UNDEF ||
+      ehdr.e_shstrndx >= ehdr.e_shnum ||
+      !InBounds(image, ehdr.e_phoff, size_t{ehdr.e_phnum} * sizeof(Phdr)) ||
+      !InBounds(image, ehdr.e_shoff, size_t{ehdr.e_shnum} * sizeof(Shdr)))
+    return false;
+  elf.phdrs.resize(ehdr.e_phnum);
+  for (size_t i = 0; i < elf.phdrs.size(); ++i) {
+    const Phdr &ph = elf.phdrs[i];
+    if (!Read(image, ehdr.e_phoff + i * sizeof(Phdr), elf.phdrs[i]) ||
+        !InBounds(image, ph.p_offset, ph.p_filesz))
+      return false;
+  }
+  elf.shdrs.resize(ehdr.e_shnum);
+  for (size_t i = 0; i < elf.shdrs.size(); ++i) {
+    const Shdr &sh = elf.shdrs[i];
+    if (!Read(image, ehdr.e_shoff + i * sizeof(Shdr), elf.shdrs[i]) ||
+        (sh.sh_type != SHT_NOBITS &&
+         !InBounds(image, sh.sh_offset, sh.sh_size)))
+      return false;
+  }
+  const Shdr &names = elf.shdrs[ehdr.e_shstrndx];
+  if (names.sh_type != SHT_STRTAB || !names.sh_size ||
+      image[names.sh_offset + names.sh_size - 1])
+    return false;
+  elf.shstrtab = {image.data() + names.sh_offset, names.sh_size};
+  return all_of(elf.shdrs.begin(), elf.shdrs.end(), [&elf](const Shdr &sh) {
+    return sh.sh_name < elf.shstrtab.size();
+  });
+}
+
+bool IsDead(string_view name) {
+  return name.starts_with(".debug_") || name.starts_with(".zdebug_") ||
+         name == ".symtab" || name == ".strtab" || name == ".comment";
+}
+
+template <typename E> vector<char> Strip(span<const char> image) {
+  using Phdr = typename E::Phdr;
+  using Shdr = typename E::Shdr;
+  Parsed<E> elf{};
+  if (!Parse(image, elf))
+    return {};
+  // Everything the loader looks at stays byte for byte where it was
+  size_t loaded =
+      max(sizeof(elf.ehdr), elf.ehdr.e_phoff + elf.phdrs.size() * sizeof(Phdr));
+  for (const Phdr &ph : elf.phdrs)
+    loaded = max<size_t>(loaded, ph.p_offset + ph.p_filesz);
+
+  const size_t count = elf.shdrs.size();
+  vector<bool> dead(count);
+  vector<size_t> index(count);
+  size_t kept = 0, first_dead = count;
+  for (size_t i = 0; i < count; ++i) {
+    const Shdr &sh = elf.shdrs[i];
+    dead[i] = i && !(sh.sh_flags & SHF_ALLOC) && sh.sh_type != SHT_NOBITS &&
+              sh.sh_offset >= loaded && IsDead(elf.Name(sh));
+    index[i] = dead[i] ? 0 : kept++;
+    if (dead[i] && first_dead == count)
+      first_dead = i;
+  }
+  if (kept == count)
+    return {};
+  // .dynsym refers to sections by index, so only trailing ones may go
+  for (size_t i = first_dead; i < count; ++i) {
+    if (!dead[i] && (elf.shdrs[i].sh_flags & SHF_ALLOC))
+      return {};
+  }
+
+  vector<char> out(image.begin(), image.begin() + loaded);
+  vector<Shdr> shdrs{};
+  shdrs.reserve(kept);
+  for (size_t i = 0; i < count; ++i) {
+    if (dead[i])
+      continue;
+    Shdr sh = elf.shdrs[i];
+    if (sh.sh_link) {
+      if (sh.sh_link >= count || dead[sh.sh_link])
+        return {};
+      sh.sh_link = index[sh.sh_link];
+    }
+    if (sh.sh_info && (sh.sh_type == SHT_REL || sh.sh_type == SHT_RELA ||
+                       (sh.sh_flags & SHF_INFO_LINK))) {
+      if (sh.sh_info >= count || dead[sh.sh_info])
+        return {};
+      sh.sh_info = index[sh.sh_info];
+    }
+    if (i && !(sh.sh_flags & SHF_ALLOC) && sh.sh_offset >= loaded) {
+      if (sh.sh_addralign > 4096)
+        return {};
+      const size_t align = max<size_t>(sh.sh_addralign, 1);
+      out.resize((out.size() + align - 1) / align * align);
+      const size_t offset = sh.sh_offset;
+      sh.sh_offset = out.size();
+      if (sh.sh_type != SHT_NOBITS)
+        out.insert(out.end(), image.begin() + offset,
+                   image.begin() + offset + sh.sh_size);
+    } else if (sh.sh_type != SHT_NOBITS && sh.sh_offset + sh.sh_size > loaded) {
+      return {};
+    }
+    shdrs.push_back(sh);
+  }
+  out.resize((out.size() + alignof(Shdr) - 1) / alignof(Shdr) * alignof(Shdr));
+  auto ehdr = elf.ehdr;
+  ehdr.e_shoff = out.size();
+  ehdr.e_shnum = kept;
+  ehdr.e_shstrndx = index[ehdr.e_shstrndx];
+  const auto *begin = reinterpret_cast<const char *>(shdrs.data());
+  out.insert(out.end(), begin, begin + shdrs.size() * sizeof(Shdr));
+  memcpy(out.data(), &ehdr, sizeof(ehdr));
+  if (out.size() >= image.size())
+    return {};
+  return out;
+}
+
+// Re-parses the stripped image and checks that it loads the same way
+template <typename E>
+bool Verify(span<const char> image, span<const char> stripped) {
+  Parsed<E> before{}, after{};
+  if (!Parse(image, before) || !Parse(stripped, after) ||
+      memcmp(before.ehdr.e_ident, after.ehdr.e_ident, EI_NIDENT) ||
+      before.ehdr.e_machine != after.ehdr.e_machine ||
+      before.ehdr.e_entry != after.ehdr.e_entry ||
+      before.ehdr.e_flags != after.ehdr.e_flags ||
+      before.phdrs.size() != after.phdrs.size())
+    return false;
+  // Only the section header fields of the ELF header may differ
+  static constexpr size_t EHDR_SIZE = sizeof(typename E::Ehdr);
+  for (size_t i = 0; i < before.phdrs.size(); ++i) {
+    const auto &ph = before.phdrs[i];
+    const size_t begin = max<size_t>(ph.p_offset, EHDR_SIZE);
+    const size_t end = ph.p_offset + ph.p_filesz;
+    if (memcmp(&ph, &after.phdrs[i], sizeof(ph)) ||
+        (begin < end && memcmp(image.data() + begin,
+                               stripped.data() + begin, end - begin)))
+      return false;
+  }
+  return true;
+}
+
+template <typename E> vector<char> StripVerified(span<const char> image) {
+  vector<char> stripped = Strip<E>(image);
+  if (!stripped.empty() && !Verify<E>(image, stripped))
+    stripped.clear();
+  return stripped;
+}
+} // namespace
+
+vector<char> StripElf(span<const char> image) {
+  if (image.size() < EI_NIDENT || memcmp(image.data(), ELFMAG, SELFMAG))
+    return {};
+  switch (image[EI_CLASS]) {
+  case ELFCLASS32:
+    return StripVerified<Elf32>(image);
+  case ELFCLASS64:
+    return StripVerified<Elf64>(image);
+  default:
+    return {};
+  }
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+// Returns the image of an ELF executable or shared library without its debug
+// info, symbol table and comments. Empty when the image is not one, can't be
+// stripped safely or nothing would be saved.
+[[nodiscard]] std::vector<char> StripElf(std::span<const char> image);
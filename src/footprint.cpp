@@ -0,0 +1,134 @@
+#include "footprint.h"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace {
+struct Usage {
+  uint64_t bytes;
+  uint64_t inodes;
+
+  Usage &operator+=(const Usage &other) {
+    bytes += other.bytes;
+    inodes += other.inodes;
+    return *this;
+  }
+};
+
+// tmpfs hands out whole pages
+constexpr uint64_t PAGE_SIZE = 4096;
+
+Usage MeasurePath(const string &path) {
+  struct stat st {};
+  if (lstat(path.c_str(), &st))
+    return {0, 0};
+  if (!S_ISREG(st.st_mode))
+    return {0, 1};
+  return {(static_cast<uint64_t>(st.st_size) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1),
+          1};
+}
+
+void WriteTable(ofstream &report, const char *title,
+                const map<string_view, Usage, less<>> &usage, size_t limit) {
+  vector<pair<string_view, Usage>> rows{usage.begin(), usage.end()};
+  sort(rows.begin(), rows.end(), [](const auto &a, const auto &b) {
+    return a.second.bytes > b.second.bytes;
+  });
+  report << '\n' << title << '\n';
+  for (size_t i = 0; i < rows.size() && i < limit; ++i) {
+    report << setw(12) << (rows[i].second.bytes >> 10) << " KiB "
+           << setw(8) << rows[i].second.inodes << " inodes  "
+           << rows[i].first << '\n';
+  }
+}
+} // namespace
+
+void Footprint::Add(const string &path, string_view owner) {
+  auto it = owner_ids.find(owner);
+  if (it == owner_ids.end()) {
+    it = owner_ids.emplace(owner, owners.size()).first;
+    owners.emplace_back(owner);
+  }
+  vector<uint32_t> &path_owners = paths[path];
+  if (find(path_owners.begin(), path_owners.end(), it->second) ==
+      path_owners.end())
+    path_owners.push_back(it->second);
+}
+
+void Footprint::Write(const char *report_path,
+                      const vector<string> &candidates) const {
+  Usage total{0, 0};
+  map<string_view, Usage, less<>> by_owner{}, exclusive{}, by_top{}, by_dir{};
+  vector<pair<string_view, Usage>> files{};
+  map<string_view, Usage, less<>> measured{};
+  for (const auto &[path, path_owners] : paths) {
+    const Usage usage = MeasurePath(path);
+    measured.emplace(path, usage);
+    total += usage;
+    for (const uint32_t owner : path_owners)
+      by_owner[owners[owner]] += usage;
+    if (path_owners.size() == 1)
+      exclusive[owners[path_owners[0]]] += usage;
+    const string_view view{path};
+    by_top[view.substr(0, view.find('/', 1))] += usage;
+    for (size_t sep = view.rfind('/'); sep && ~sep;
+         sep = view.rfind('/', sep - 1))
+      by_dir[view.substr(0, sep)] += usage;
+    if (usage.bytes)
+      files.emplace_back(view, usage);
+  }
+  const size_t largest = min<size_t>(files.size(), 25);
+  partial_sort(files.begin(), files.begin() + static_cast<ptrdiff_t>(largest),
+               files.end(), [](const auto &a, const auto &b) {
+                 return a.second.bytes > b.second.bytes;
+               });
+  files.resize(largest);
+
+  ofstream report{report_path};
+  report << "Total " << (total.bytes >> 10) << " KiB in " << total.inodes
+         << " inodes\n";
+  WriteTable(report, "By package or include dir (shared paths count for each)",
+             by_owner, SIZE_MAX);
+  WriteTable(report, "Owned exclusively, saved by dropping the owner",
+             exclusive, SIZE_MAX);
+  WriteTable(report, "By top-level directory", by_top, SIZE_MAX);
+  WriteTable(report, "Largest directories", by_dir, 40);
+  report << "\nLargest files\n";
+  for (const auto &[path, usage] : files)
+    report << setw(12) << (usage.bytes >> 10) << " KiB  " << path << '\n';
+  if (candidates.empty())
+    return;
+  report << "\nWhat if excluded\n";
+  for (const string &candidate : candidates) {
+    Usage saved{0, 0};
+    if (candidate[0] != '/') {
+      // A package takes only the paths nothing else pulled in. Its
+      // dependencies may go too, that isn't counted.
+      const auto owner = owner_ids.find(candidate);
+      if (owner == owner_ids.end()) {
+        report << "             not a path or a package in the BOM  "
+               << candidate << '\n';
+        continue;
+      }
+      for (const auto &[path, path_owners] : paths) {
+        if (path_owners.size() == 1 && path_owners[0] == owner->second)
+          saved += measured.find(string_view{path})->second;
+      }
+    } else {
+      const string prefix{candidate + '/'};
+      const auto self = measured.find(string_view{candidate});
+      if (self != measured.end())
+        saved += self->second;
+      for (auto it = measured.lower_bound(string_view{prefix});
+           it != measured.end() && it->first.starts_with(prefix); ++it)
+        saved += it->second;
+    }
+    report << setw(12) << (saved.bytes >> 10) << " KiB " << setw(8)
+           << saved.inodes << " inodes saved, leaving "
+           << ((total.bytes - saved.bytes) >> 10) << " KiB  " << candidate
+           << '\n';
+  }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Attributes the in-memory size of the BOM to the packages and include dirs
+// that pulled each path in
+class Footprint {
+  std::map<std::string, std::vector<uint32_t>, std::less<>> paths;
+  std::vector<std::string> owners;
+  std::map<std::string, uint32_t, std::less<>> owner_ids;
+
+public:
+  void Add(const std::string &path, std::string_view owner);
+
+  [[nodiscard]] bool Has(std::string_view path) const {
+    return paths.contains(path);
+  }
+
+  void Write(const char *report_path,
+             const std::vector<std::string> &candidates) const;
+};
@@ -1,22 +1,44 @@
+#include "background.h"
+#include "footprint.h"
 #include "trie.h"
 #include "work_file.h"
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <ext/stdio_filebuf.h>
 #include <fcntl.h>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <poll.h>
 #include <set>
+#include <sstream>
+#include <sys/inotify.h>
 #include <sys/stat.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
+#include <utility>
 #include <iostream>
 
 using namespace std;
 
 namespace {
+Throttle throttle{};
+
 struct Options {
   const Trie exclude_paths;
   const vector<string> include_dirs;
   const vector<string> include_pkgs;
+  const vector<string> critical_paths;
+  const vector<string> critical_pkgs;
+  // Modules to keep besides the loaded ones, by name
+  const vector<string> extra_modules;
 };
 
 template <bool PKG_ELSE_PATH>
@@ -56,6 +78,11 @@ template <bool PKG_ELSE_PATH>
       .exclude_paths{std::move(exclude_paths)},
       .include_dirs{LoadFileLines<false>(CONFIG_PATH "include_dirs.txt")},
       .include_pkgs{LoadFileLines<true>(CONFIG_PATH "include_packages.txt")},
+      .critical_paths{LoadFileLines<false>(CONFIG_PATH "critical_paths.txt")},
+      .critical_pkgs{LoadFileLines<true>(CONFIG_PATH "critical_packages.txt")},
+      .extra_modules{filesystem::exists(CONFIG_PATH "extra_modules.txt")
+                         ? LoadFileLines<true>(CONFIG_PATH "extra_modules.txt")
+                         : vector<string>{}},
   };
 #undef CONFIG_PATH
 }
@@ -67,7 +94,8 @@ template <typename T> class Subprocess {
 
   int Init(const void *args) {
     int pipefd[2];
-    if (pipe(pipefd))
+    // Other threads fork too, and a leaked write end would hold off EOF
+    if (pipe2(pipefd, O_CLOEXEC))
       abort();
     pid_t pid = fork();
     if (pid < 0)
@@ -201,14 +229,17 @@ set<string> LoadDpkgNecessary() {
   return roots;
 }
 
-void CompleteDependencies(set<string> &roots) {
+// Calls back with each package of the closure as soon as apt-cache names it
+template <typename F> void CompleteDependencies(set<string> &roots, F &&added) {
   string s;
   s.reserve(100);
   set<string> result;
   vector<const char *> args{"/usr/bin/apt-cache", "depends", "-i", "--recurse"};
   args.reserve(3 * roots.size());
   for (auto &root : roots) {
-    args.emplace_back(result.emplace(std::move(root)).first->c_str());
+    const string &package = *result.emplace(std::move(root)).first;
+    added(package);
+    args.emplace_back(package.c_str());
   }
   args.emplace_back(nullptr);
   {
@@ -221,12 +252,17 @@ void CompleteDependencies(set<string> &roots) {
       const auto dep{!~sep ? dep_ : dep_.substr(0, sep)};
       if (dep.empty())
         abort();
-      result.emplace(dep);
+      if (const auto [it, inserted] = result.emplace(dep); inserted)
+        added(*it);
     }
   }
   roots = std::move(result);
 }
 
+void CompleteDependencies(set<string> &roots) {
+  CompleteDependencies(roots, [](const string &) {});
+}
+
 void CollectPackagePaths(int fd, set<string> &result,
                          const Trie &exclude_paths) noexcept {
   __gnu_cxx::stdio_filebuf<char> file{fd, ios::in};
@@ -243,7 +279,7 @@ void CollectPackagePaths(int fd, set<string> &result,
       continue;
     if (s.ends_with('.'))
       abort();
-    if (exclude_paths.HasPath(string_view{s}.substr(1)))
+    if (exclude_paths.CoversPath(string_view{s}.substr(1)))
       continue;
     result.emplace(std::move(s));
   }
@@ -269,6 +305,7 @@ void CollectPackagesPaths(const set<string> &packages, set<string> &result,
     basename.append(package);
     basename.append(PKG_UNI_SUFFIX);
 #define OpenInfo(x) openat(dir, x.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW)
+    throttle.Pace(0, 1);
     int fd = OpenInfo(basename);
     if (fd >= 0) {
       CollectPackagePaths(fd, result, exclude_paths);
@@ -292,19 +329,182 @@ void CollectPackagesPaths(const set<string> &packages, set<string> &result,
     abort();
 }
 
+// Calls back for each path under root that isn't excluded, parents first,
+// without descending into excluded directories. A directory that vanishes
+// during the walk is left out, any other error stops the gather.
+template <typename F>
+void WalkIncludeDir(const string &root, const Trie &exclude_paths, F &&f) {
+  if (exclude_paths.CoversPath(string_view{root}.substr(1)))
+    return;
+  f(root);
+  // One directory at a time, as recursive_directory_iterator ends the whole
+  // walk on the first error
+  vector<string> pending{root};
+  while (!pending.empty()) {
+    const string dir{std::move(pending.back())};
+    pending.pop_back();
+    error_code ec{};
+    filesystem::directory_iterator it{
+        dir, filesystem::directory_options::skip_permission_denied, ec};
+    for (; !ec && it != filesystem::directory_iterator{}; it.increment(ec)) {
+      throttle.Pace(0, 1);
+      const string &path = it->path().native();
+      if (exclude_paths.CoversPath(string_view{path}.substr(1)))
+        continue;
+      f(path);
+      error_code type_ec{};
+      if (it->symlink_status(type_ec).type() ==
+          filesystem::file_type::directory)
+        pending.push_back(path);
+    }
+    if (ec && ec != errc::no_such_file_or_directory &&
+        ec != errc::not_a_directory) {
+      cerr << "Walking " << dir << " failed: " << ec.message() << endl;
+      abort();
+    }
+  }
+}
+
 void CollectIncludeDirs(const vector<string> &include_dirs,
-                        set<string> &result) {
+                        set<string> &result, const Trie &exclude_paths) {
   for (const string &root : include_dirs) {
-    for (const filesystem::directory_entry &entry :
-         filesystem::recursive_directory_iterator(
-             root, filesystem::directory_options::skip_permission_denied)) {
-      result.emplace(entry.path().c_str());
+    WalkIncludeDir(root, exclude_paths,
+                   [&result](const string &path) { result.emplace(path); });
+  }
+}
+
+void InsertParents(set<string> &paths) {
+  vector<string> parents{};
+  for (const string &path : paths) {
+    for (size_t sep = path.rfind('/'); sep && ~sep;
+         sep = path.rfind('/', sep - 1)) {
+      parents.emplace_back(path, 0, sep);
     }
   }
+  paths.insert(parents.begin(), parents.end());
 }
 
-void OutputPath(const string &path, ofstream &bom) {
+// Files recorded by the record command
+struct Profile {
+  set<string> paths;
+  // Take every package the profile touched whole instead of file by file
+  bool margin;
+};
+
+[[nodiscard]] bool IsSymlink(const string &path) {
+  struct stat st {};
+  return !lstat(path.c_str(), &st) && S_ISLNK(st.st_mode);
+}
+
+// fanotify reports resolved paths, so /lib/x is recorded as /usr/lib/x
+class Resolver {
+  map<string, string, less<>> dirs_{};
+
+public:
+  [[nodiscard]] string Resolve(const string &path) {
+    const size_t sep = path.rfind('/');
+    if (!sep || sep == string::npos)
+      return path;
+    const string_view dir{path.data(), sep};
+    auto it = dirs_.find(dir);
+    if (it == dirs_.end()) {
+      error_code ec{};
+      string resolved{filesystem::canonical(dir, ec)};
+      it = dirs_.emplace(dir, ec ? string{dir} : std::move(resolved)).first;
+    }
+    return it->second + path.substr(sep);
+  }
+};
+
+// Keeps only the packages the profile touched, and of those only the
+// recorded files and the symlinks that may lead to them
+void CollectProfiledPaths(const Profile &profile,
+                          const map<string, set<string>> &packages,
+                          set<string> &result) {
+  Resolver resolver{};
+  vector<string> touched{};
+  for (const auto &[package, package_paths] : packages) {
+    touched.clear();
+    for (const string &path : package_paths) {
+      if (profile.paths.contains(resolver.Resolve(path)))
+        touched.push_back(path);
+    }
+    if (touched.empty())
+      continue;
+    if (profile.margin) {
+      result.insert(package_paths.begin(), package_paths.end());
+      continue;
+    }
+    result.insert(touched.begin(), touched.end());
+    for (const string &path : package_paths) {
+      if (IsSymlink(path))
+        result.insert(path);
+    }
+  }
+  InsertParents(result);
+}
+
+void CollectCriticalPaths(const Options &options, set<string> &critical) {
+  set<string> packages{options.critical_pkgs.begin(),
+                       options.critical_pkgs.end()};
+  CompleteDependencies(packages);
+  CollectPackagesPaths(packages, critical, options.exclude_paths);
+  for (const string &path : options.critical_paths) {
+    if (!options.exclude_paths.CoversPath(string_view{path}.substr(1)))
+      critical.emplace(path);
+  }
+  // The critical tier is copied on its own, so it must carry its parents
+  InsertParents(critical);
+}
+
+// Largest --inline=, each inlined file is buffered whole
+constexpr size_t MAX_INLINE = 1 << 20;
+
+// Contents of small files, written after the entries so that build_ramdisk
+// can create them without opening the source
+struct Payloads {
+  // 0 to inline only what gather made up itself
+  size_t limit;
+  string data;
+  // Files that exist only in the ramdisk, by path
+  map<string, string> generated;
+};
+
+// Returns whether the whole file went into the data section, expecting the
+// size lstat saw
+bool InlinePayload(const string &path, char type, size_t expected,
+                   ostream &bom, Payloads &payloads) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0)
+    return false;
+  const size_t offset = payloads.data.size();
+  // One byte more tells a file that grew since the lstat
+  payloads.data.resize(offset + expected + 1);
+  size_t size = 0;
+  for (ssize_t ret; size <= expected; size += ret) {
+    ret = read(fd, payloads.data.data() + offset + size, expected + 1 - size);
+    if (ret <= 0) {
+      if (ret < 0)
+        size = expected + 1;
+      break;
+    }
+  }
+  if (close(fd))
+    abort();
+  const bool fits = size <= expected && (size || type != COPY_EXE);
+  payloads.data.resize(fits ? offset + size : offset);
+  if (fits) {
+    bom << static_cast<char>(type == COPY_EXE ? COPY_EXE_INLINE
+                                              : COPY_DAT_INLINE)
+        << offset << ' ' << size << path << '\n';
+  }
+  return fits;
+}
+
+void OutputPath(const string &path, ostream &bom,
+                Payloads *payloads = nullptr) {
   assert(path[0] == '/');
+  throttle.Pace(0, 1);
   struct stat st {};
   if (lstat(path.c_str(), &st))
     return;
@@ -321,36 +521,830 @@ void OutputPath(const string &path, ofstream &bom) {
     return;
   }
 
+  if (payloads && payloads->limit && S_ISREG(mode) &&
+      static_cast<size_t>(st.st_size) <= payloads->limit &&
+      InlinePayload(path, type, st.st_size, bom, *payloads))
+    return;
   bom << type << path << '\n';
 }
 
-void Run() {
-  const Options options{LoadCustomFileList()};
-  set<string> paths{};
+// The running kernel's modules that are loaded or asked for, and the index
+// files modprobe needs to find just those
+struct Modules {
+  // Where the running kernel's modules are, with a trailing slash
+  string dir;
+  // Module files, the files depmod reads besides them, and their parents
+  set<string> paths;
+  // Index files regenerated for the subset, by path
+  map<string, string> generated;
+};
+
+// modprobe and /proc/modules spell dm-crypt.ko.zst as dm_crypt
+[[nodiscard]] string ModuleName(string_view path) {
+  path = path.substr(path.rfind('/') + 1);
+  string name{path.substr(0, path.find(".ko"))};
+  replace(name.begin(), name.end(), '-', '_');
+  return name;
+}
+
+[[nodiscard]] string ReadFile(const string &path) {
+  ifstream f{path};
+  if (!f)
+    abort();
+  return {istreambuf_iterator<char>{f}, istreambuf_iterator<char>{}};
+}
+
+// Lets depmod index the subset through a tree of symlinks and takes what it
+// writes. Returns false if there is no depmod.
+bool RunDepmod(const string &release, Modules &modules) {
+  static constexpr const char *DEPMOD = "/sbin/depmod";
+  if (access(DEPMOD, X_OK))
+    return false;
+  static constexpr const char *STAGING = "tmpfs_modules";
+  filesystem::remove_all(STAGING);
+  const string staging{STAGING + modules.dir};
+  for (const string &path : modules.paths) {
+    if (!path.starts_with(modules.dir))
+      continue;
+    struct stat st {};
+    if (lstat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+      continue;
+    const filesystem::path link{STAGING + path};
+    filesystem::create_directories(link.parent_path());
+    filesystem::create_symlink(path, link);
+  }
+  const pid_t pid = fork();
+  if (pid < 0)
+    abort();
+  if (!pid) {
+    execl(DEPMOD, "depmod", "-b", STAGING, release.c_str(), nullptr);
+    abort();
+  }
+  int wstatus;
+  if (waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus) ||
+      WEXITSTATUS(wstatus))
+    abort();
+  modules.generated.clear();
+  for (const auto &entry : filesystem::directory_iterator{staging}) {
+    const string name{entry.path().filename()};
+    if (name.starts_with("modules.") && !entry.is_symlink() &&
+        entry.is_regular_file())
+      modules.generated.emplace(modules.dir + name, ReadFile(entry.path()));
+  }
+  filesystem::remove_all(STAGING);
+  return true;
+}
+
+// The dependency closure of the loaded and extra modules less the excluded
+// ones, or false if the running kernel has no modules.dep
+bool CollectModules(const Options &options, Modules &modules) {
+  struct utsname uts {};
+  if (uname(&uts))
+    abort();
+  modules.dir = "/lib/modules/"s + uts.release + '/';
+  ifstream dep{modules.dir + "modules.dep"};
+  if (!dep)
+    return false;
+  // Paths relative to dir, as modules.dep has them
+  vector<pair<string, string>> lines{};
+  map<string, vector<string>> deps{};
+  map<string, string> files{};
+  for (string l{}; getline(dep, l);) {
+    const size_t colon = l.find(':');
+    if (colon == string::npos)
+      continue;
+    const string file{l, 0, colon};
+    istringstream rest{l.substr(colon + 1)};
+    deps.emplace(file, vector<string>{istream_iterator<string>{rest},
+                                      istream_iterator<string>{}});
+    files.emplace(ModuleName(file), file);
+    lines.emplace_back(file, std::move(l));
+  }
+  set<string> builtin{};
+  {
+    ifstream f{modules.dir + "modules.builtin"};
+    for (string l{}; getline(f, l);)
+      builtin.insert(ModuleName(l));
+  }
+  vector<string> wanted{};
+  for (const string &name : options.extra_modules)
+    wanted.push_back(ModuleName(name));
+  {
+    ifstream loaded{"/proc/modules"};
+    for (string l{}; getline(loaded, l);)
+      wanted.push_back(l.substr(0, l.find(' ')));
+  }
+  set<string> kept{};
+  for (const string &name : wanted) {
+    const auto it = files.find(name);
+    if (it == files.end()) {
+      if (!builtin.contains(name))
+        printf("Module %s is not in modules.dep\n", name.c_str());
+      continue;
+    }
+    vector<string> pending{it->second};
+    while (!pending.empty()) {
+      string file{std::move(pending.back())};
+      pending.pop_back();
+      if (options.exclude_paths.CoversPath(
+              string_view{modules.dir + file}.substr(1)) ||
+          !kept.insert(file).second)
+        continue;
+      const auto d = deps.find(file);
+      if (d != deps.end())
+        pending.insert(pending.end(), d->second.begin(), d->second.end());
+    }
+  }
+  for (const string &file : kept)
+    modules.paths.insert(modules.dir + file);
+  for (const char *name :
+       {"modules.order", "modules.builtin", "modules.builtin.modinfo"}) {
+    const string path{modules.dir + name};
+    if (filesystem::exists(path) &&
+        !options.exclude_paths.CoversPath(string_view{path}.substr(1)))
+      modules.paths.insert(path);
+  }
+  InsertParents(modules.paths);
+
+  // Plain text is all busybox modprobe reads, and all there is without depmod
+  string &dep_subset = modules.generated[modules.dir + "modules.dep"];
+  for (const auto &[file, l] : lines) {
+    if (kept.contains(file))
+      dep_subset += l + '\n';
+  }
+  set<string> names{};
+  for (const string &file : kept)
+    names.insert(ModuleName(file));
+  string &alias_subset = modules.generated[modules.dir + "modules.alias"];
+  {
+    ifstream f{modules.dir + "modules.alias"};
+    for (string l{}; getline(f, l);) {
+      if (l.starts_with("alias ") &&
+          names.contains(l.substr(l.rfind(' ') + 1)))
+        alias_subset += l + '\n';
+    }
+  }
+  if (!RunDepmod(uts.release, modules))
+    puts("No depmod, so the ramdisk gets no binary module indexes");
+  printf("Keeping %zu of %zu modules for %s\n", kept.size(), deps.size(),
+         uts.release);
+  return true;
+}
+
+// Replaces whatever the packages and include dirs brought of the running
+// kernel's modules with the subset, sparing the pinned paths and parents
+void TrimModules(const Modules &modules, const set<string> &pinned,
+                 set<string> &paths) {
+  const string usr_dir{"/usr" + modules.dir};
+  erase_if(paths, [&modules, &pinned, &usr_dir](const string &path) {
+    return (path.starts_with(modules.dir) || path.starts_with(usr_dir)) &&
+           !modules.paths.contains(path) && !pinned.contains(path);
+  });
+}
+
+[[nodiscard]] set<string> ResolvePackages(const Options &options) {
   set<string> packages = LoadDpkgNecessary();
   packages.insert(options.include_pkgs.begin(), options.include_pkgs.end());
+  packages.insert(options.critical_pkgs.begin(), options.critical_pkgs.end());
   CompleteDependencies(packages);
-  CollectPackagesPaths(packages, paths, options.exclude_paths);
-  CollectIncludeDirs(options.include_dirs, paths);
-  ofstream bom{WORK_FILE_NAME};
-  for (auto &s : paths) {
-    OutputPath(s, bom);
+  return packages;
+}
+
+// Replaces the BOM atomically so readers never see a partial one; entry
+// writes the line of one path
+template <typename Paths, typename Entry>
+void WriteBomWith(const set<string> &critical, const Paths &paths,
+                  const Entry &entry, Payloads *payloads = nullptr) {
+  static constexpr const char *TEMP_NAME = WORK_FILE_NAME ".tmp";
+  {
+    ofstream bom{TEMP_NAME};
+    for (auto &s : critical) {
+      entry(s, bom);
+    }
+    bom << static_cast<char>(TIER_BULK) << '\n';
+    for (const string &s : paths) {
+      if (!critical.contains(s))
+        entry(s, bom);
+    }
+    if (payloads) {
+      // Last, so their directories already exist
+      for (const auto &[path, contents] : payloads->generated) {
+        bom << static_cast<char>(COPY_DAT_INLINE) << payloads->data.size()
+            << ' ' << contents.size() << path << '\n';
+        payloads->data += contents;
+      }
+      bom << static_cast<char>(DATA_SECTION) << '\n' << payloads->data;
+    }
+    if (!bom.flush())
+      abort();
+  }
+  if (rename(TEMP_NAME, WORK_FILE_NAME))
+    abort();
+}
+
+template <typename Paths>
+void WriteBom(const set<string> &critical, const Paths &paths,
+              Payloads *payloads = nullptr) {
+  WriteBomWith(
+      critical, paths,
+      [payloads](const string &path, ostream &bom) {
+        OutputPath(path, bom, payloads);
+      },
+      payloads);
+}
+
+using PackagePaths = map<string, set<string>>;
+
+// dirs holds the paths of each include dir, as the gather walked them
+void Report(const set<string> &critical, const PackagePaths &packages,
+            const PackagePaths &dirs, const set<string> &selected) {
+  Footprint footprint{};
+  for (const auto &[package, package_paths] : packages) {
+    for (const string &path : package_paths) {
+      // A profile may have trimmed the package
+      if (selected.contains(path))
+        footprint.Add(path, package);
+    }
+  }
+  for (const auto &[root, dir_paths] : dirs) {
+    for (const string &path : dir_paths)
+      footprint.Add(path, "dir:" + root);
+  }
+  // Only what no package or include dir explains
+  for (const string &path : critical) {
+    if (!footprint.Has(path))
+      footprint.Add(path, "critical");
   }
+  // Paths or package names
+  static constexpr const char *CANDIDATES = "config/candidate_excludes.txt";
+  footprint.Write(REPORT_FILE_NAME,
+                  filesystem::exists(CANDIDATES)
+                      ? LoadFileLines<true>(CANDIDATES)
+                      : vector<string>{});
 }
+
+// What dpkg and apt-cache read, which a gather keeps going over
+[[nodiscard]] size_t PackageDatabaseSize() {
+  size_t size = 0;
+  for (const char *dir : {"/var/lib/dpkg", "/var/lib/apt/lists"}) {
+    error_code ec{};
+    for (filesystem::recursive_directory_iterator it{dir, ec}, end{};
+         !ec && it != end; it.increment(ec)) {
+      error_code file_ec{};
+      const uintmax_t bytes = it->file_size(file_ec);
+      if (!file_ec && it->is_regular_file(file_ec))
+        size += bytes;
+    }
+  }
+  return size;
+}
+
+// Runs the independent parts of a gather side by side. Only the thread that
+// owns the pool waits on results, so workers never block on each other.
+class TaskPool {
+  mutex mutex_{};
+  condition_variable ready_{};
+  deque<function<void()>> tasks_{};
+  bool stopping_{};
+  vector<jthread> workers_{};
+
+  void Work() {
+    for (;;) {
+      function<void()> task{};
+      {
+        unique_lock lock{mutex_};
+        ready_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+        if (tasks_.empty())
+          return;
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+public:
+  // Most tasks wait on dpkg, apt-cache or the disk, so more than one per CPU
+  TaskPool() {
+    const unsigned int count = max(thread::hardware_concurrency(), 4u);
+    for (unsigned int i = 0; i < count; ++i)
+      workers_.emplace_back([this] { Work(); });
+  }
+
+  ~TaskPool() {
+    {
+      const lock_guard lock{mutex_};
+      stopping_ = true;
+    }
+    ready_.notify_all();
+  }
+
+  TaskPool(const TaskPool &) = delete;
+  TaskPool &operator=(const TaskPool &) = delete;
+
+  template <typename F> [[nodiscard]] auto Submit(F &&f) {
+    auto task = make_shared<packaged_task<invoke_result_t<F>()>>(
+        std::forward<F>(f));
+    auto result = task->get_future();
+    {
+      const lock_guard lock{mutex_};
+      tasks_.emplace_back([task] { (*task)(); });
+    }
+    ready_.notify_one();
+    return result;
+  }
+};
+
+// The priority query starts before the config is even read, the include dirs
+// and the critical tier are walked alongside, and each package's list is
+// parsed as soon as apt-cache names it
+void Run(bool report, const Profile *profile, size_t inline_limit,
+         bool loaded_modules) {
+  TaskPool pool{};
+  auto necessary = pool.Submit(LoadDpkgNecessary);
+  const Options options{LoadCustomFileList()};
+  // By include dir, so that the report needs no second walk
+  auto include_paths = pool.Submit([&options] {
+    PackagePaths dirs{};
+    for (const string &root : options.include_dirs)
+      CollectIncludeDirs({root}, dirs[root], options.exclude_paths);
+    return dirs;
+  });
+  auto critical_paths = pool.Submit([&options] {
+    set<string> critical{};
+    CollectCriticalPaths(options, critical);
+    return critical;
+  });
+
+  set<string> roots{necessary.get()};
+  roots.insert(options.include_pkgs.begin(), options.include_pkgs.end());
+  roots.insert(options.critical_pkgs.begin(), options.critical_pkgs.end());
+  map<string, future<set<string>>> lists{};
+  CompleteDependencies(roots, [&pool, &options, &lists](const string &package) {
+    lists.emplace(package, pool.Submit([&options, package] {
+      set<string> paths{};
+      CollectPackagesPaths({package}, paths, options.exclude_paths);
+      return paths;
+    }));
+  });
+  PackagePaths packages{};
+  for (auto &[package, list] : lists)
+    packages.emplace(package, list.get());
+
+  set<string> paths{};
+  if (profile) {
+    CollectProfiledPaths(*profile, packages, paths);
+  } else {
+    for (const auto &[package, package_paths] : packages)
+      paths.insert(package_paths.begin(), package_paths.end());
+  }
+  PackagePaths dirs{include_paths.get()};
+  for (auto &[root, dir_paths] : dirs) {
+    if (report)
+      paths.insert(dir_paths.begin(), dir_paths.end());
+    else
+      paths.merge(dir_paths);
+  }
+  set<string> critical{critical_paths.get()};
+  Payloads payloads{.limit = inline_limit, .data{}, .generated{}};
+  if (loaded_modules) {
+    Modules modules{};
+    if (CollectModules(options, modules)) {
+      // Modules someone listed as critical stay whether loaded or not
+      set<string> pinned{options.critical_paths.begin(),
+                         options.critical_paths.end()};
+      InsertParents(pinned);
+      TrimModules(modules, pinned, critical);
+      TrimModules(modules, pinned, paths);
+      paths.insert(modules.paths.begin(), modules.paths.end());
+      payloads.generated = std::move(modules.generated);
+    } else {
+      puts("No modules.dep for the running kernel, leaving modules as they "
+           "are");
+    }
+  }
+  if (inline_limit || !payloads.generated.empty())
+    WriteBom(critical, paths, &payloads);
+  else
+    WriteBom(critical, paths);
+  if (report)
+    Report(critical, packages, dirs, paths);
+}
+
+// Batches of paths from the pool's tasks, each written whole and in order.
+// Pop returns false once every producer has closed and nothing is left.
+class BatchQueue {
+  mutex mutex_{};
+  condition_variable ready_{};
+  deque<vector<string>> batches_{};
+  size_t producers_{};
+
+public:
+  void Open() {
+    const lock_guard lock{mutex_};
+    ++producers_;
+  }
+
+  void Push(vector<string> batch) {
+    {
+      const lock_guard lock{mutex_};
+      batches_.push_back(std::move(batch));
+    }
+    ready_.notify_one();
+  }
+
+  void Close() {
+    {
+      const lock_guard lock{mutex_};
+      --producers_;
+    }
+    ready_.notify_one();
+  }
+
+  [[nodiscard]] bool Pop(vector<string> &batch) {
+    unique_lock lock{mutex_};
+    ready_.wait(lock, [this] { return !batches_.empty() || !producers_; });
+    if (batches_.empty())
+      return false;
+    batch = std::move(batches_.front());
+    batches_.pop_front();
+    return true;
+  }
+};
+
+// Writes the BOM to stdout as it is discovered so build_ramdisk can start
+// copying before the gather is over. The include dirs are walked and the
+// packages resolved and listed on the pool while the critical tier is
+// collected, and whatever batch is done first goes out first. Parents still
+// come before their children: the critical tier is sorted, each include dir
+// is walked top-down after its parents and each package's list is sorted and
+// names its own directories.
+void Stream() {
+  static constexpr size_t WALK_BATCH = 256;
+  const Options options{LoadCustomFileList()};
+  BatchQueue queue{};
+  TaskPool pool{};
+  for (const string &root : options.include_dirs) {
+    queue.Open();
+    static_cast<void>(pool.Submit([&options, &queue, root] {
+      // No package may have brought the root's parents yet
+      set<string> parents{root};
+      InsertParents(parents);
+      parents.erase(root);
+      vector<string> batch{parents.begin(), parents.end()};
+      WalkIncludeDir(root, options.exclude_paths,
+                     [&queue, &batch](const string &path) {
+                       batch.push_back(path);
+                       if (batch.size() >= WALK_BATCH)
+                         queue.Push(std::exchange(batch, {}));
+                     });
+      queue.Push(std::move(batch));
+      queue.Close();
+    }));
+  }
+  queue.Open();
+  static_cast<void>(pool.Submit([&options, &queue, &pool] {
+    set<string> roots{LoadDpkgNecessary()};
+    roots.insert(options.include_pkgs.begin(), options.include_pkgs.end());
+    roots.insert(options.critical_pkgs.begin(), options.critical_pkgs.end());
+    CompleteDependencies(roots, [&options, &queue, &pool](
+                                    const string &package) {
+      queue.Open();
+      static_cast<void>(pool.Submit([&options, &queue, package] {
+        set<string> paths{};
+        CollectPackagesPaths({package}, paths, options.exclude_paths);
+        queue.Push({paths.begin(), paths.end()});
+        queue.Close();
+      }));
+    });
+    queue.Close();
+  }));
+
+  set<string> critical{};
+  CollectCriticalPaths(options, critical);
+  for (const string &s : critical)
+    OutputPath(s, cout);
+  cout << static_cast<char>(TIER_BULK) << endl;
+  set<string> paths{};
+  for (vector<string> batch{}; queue.Pop(batch);) {
+    for (const string &path : batch) {
+      if (paths.emplace(path).second && !critical.contains(path))
+        OutputPath(path, cout);
+    }
+    cout.flush();
+  }
+  if (!cout.flush())
+    abort();
+  WriteBom(critical, paths);
+}
+
+// Keeps the BOM up to date from inotify events until the config changes
+class Watcher {
+  static constexpr string_view DPKG_DIR = "/var/lib/dpkg";
+  static constexpr string_view INFO_DIR = "/var/lib/dpkg/info";
+  // Bursts such as a dpkg run settle before a rewrite, but one that never
+  // settles still gets one this often
+  static constexpr chrono::milliseconds QUIET{1000};
+  static constexpr chrono::milliseconds MAX_DELAY{10000};
+
+  const Options options;
+  const int inotify;
+  int config_wd, dpkg_wd, info_wd;
+  set<string> critical;
+  set<string> packages;
+  map<string, set<string>, less<>> package_paths;
+  set<string> dir_paths;
+  map<int, string> dir_watches;
+  // BOM lines by path, so a rewrite lstats only what inotify reported
+  map<string, string, less<>> entries;
+  bool dirty;
+  chrono::steady_clock::time_point dirty_since;
+
+  void Watch(const string &dir) {
+    const int wd =
+        inotify_add_watch(inotify, dir.c_str(),
+                          IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                              IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd >= 0)
+      dir_watches[wd] = dir;
+  }
+
+  void AddTree(const string &root) {
+    WalkIncludeDir(root, options.exclude_paths, [this](const string &path) {
+      dir_paths.emplace(path);
+      entries.erase(path);
+      if (filesystem::is_directory(filesystem::symlink_status(path)))
+        Watch(path);
+    });
+  }
+
+  void RemoveTree(const string &root) {
+    const string prefix{root + '/'};
+    dir_paths.erase(root);
+    dir_paths.erase(dir_paths.lower_bound(prefix),
+                    dir_paths.lower_bound(root + static_cast<char>('/' + 1)));
+  }
+
+  void CollectPackage(const string &package) {
+    set<string> &paths = package_paths[package];
+    paths.clear();
+    CollectPackagesPaths({package}, paths, options.exclude_paths);
+    // Whatever dpkg unpacked may have replaced them
+    for (const string &path : paths)
+      entries.erase(path);
+  }
+
+  void ReloadPackages() {
+    critical.clear();
+    CollectCriticalPaths(options, critical);
+    for (const string &path : critical)
+      entries.erase(path);
+    set<string> next = ResolvePackages(options);
+    for (auto it = package_paths.begin(); it != package_paths.end();) {
+      it = next.contains(it->first) ? std::next(it) : package_paths.erase(it);
+    }
+    for (const string &package : next) {
+      if (!packages.contains(package))
+        CollectPackage(package);
+    }
+    packages = std::move(next);
+  }
+
+  void ReloadDirs() {
+    for (const auto &[wd, dir] : dir_watches)
+      inotify_rm_watch(inotify, wd);
+    dir_watches.clear();
+    dir_paths.clear();
+    for (const string &root : options.include_dirs)
+      AddTree(root);
+  }
+
+  // Returns false once the configuration has changed
+  bool Handle(const inotify_event &event) {
+    if (event.mask & IN_Q_OVERFLOW) {
+      entries.clear();
+      ReloadPackages();
+      ReloadDirs();
+      return true;
+    }
+    const string_view name{event.len ? event.name : ""};
+    if (event.wd == config_wd)
+      return false;
+    if (event.wd == dpkg_wd) {
+      if (name == "status")
+        ReloadPackages();
+      return true;
+    }
+    if (event.wd == info_wd) {
+      if (!name.ends_with(".list"))
+        return true;
+      string_view package{name.substr(0, name.size() - ".list"sv.size())};
+      package = package.substr(0, package.find(':'));
+      const auto it = packages.find(string{package});
+      if (it != packages.end())
+        CollectPackage(*it);
+      return true;
+    }
+    const auto it = dir_watches.find(event.wd);
+    if (it == dir_watches.end())
+      return true;
+    if (event.mask & IN_IGNORED) {
+      dir_watches.erase(it);
+      return true;
+    }
+    const string path{it->second + '/' + string{name}};
+    if (event.mask & (IN_CREATE | IN_MOVED_TO))
+      AddTree(path);
+    else if (event.mask & (IN_DELETE | IN_MOVED_FROM))
+      RemoveTree(path);
+    else if (event.mask & IN_ATTRIB)
+      entries.erase(path);
+    return true;
+  }
+
+  [[nodiscard]] int AddWatch(string_view path, uint32_t mask) const {
+    const int wd = inotify_add_watch(inotify, string{path}.c_str(), mask);
+    if (wd < 0)
+      abort();
+    return wd;
+  }
+
+  void Write() {
+    set<reference_wrapper<const string>, less<string>> paths{
+        dir_paths.begin(), dir_paths.end()};
+    for (const auto &[package, package_set] : package_paths)
+      paths.insert(package_set.begin(), package_set.end());
+    // Dropping the lines of paths that left the BOM
+    map<string, string, less<>> kept{};
+    WriteBomWith(critical, paths,
+                 [this, &kept](const string &path, ostream &bom) {
+                   auto it = entries.find(path);
+                   if (it == entries.end()) {
+                     ostringstream line{};
+                     OutputPath(path, line);
+                     it = entries.emplace(path, std::move(line).str()).first;
+                   }
+                   bom << it->second;
+                   kept.insert(entries.extract(it));
+                 });
+    entries = std::move(kept);
+  }
+
+public:
+  Watcher()
+      : options{LoadCustomFileList()},
+        inotify{inotify_init1(IN_CLOEXEC)}, config_wd{}, dpkg_wd{}, info_wd{},
+        critical{}, packages{}, package_paths{}, dir_paths{}, dir_watches{},
+        entries{}, dirty{true}, dirty_since{chrono::steady_clock::now()} {
+    if (inotify < 0)
+      abort();
+    config_wd = AddWatch("config", IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+    dpkg_wd = AddWatch(DPKG_DIR, IN_CLOSE_WRITE | IN_MOVED_TO);
+    info_wd = AddWatch(INFO_DIR, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE |
+                                     IN_MOVED_FROM);
+    ReloadPackages();
+    ReloadDirs();
+  }
+
+  ~Watcher() { close(inotify); }
+
+  Watcher(const Watcher &) = delete;
+  Watcher &operator=(const Watcher &) = delete;
+  Watcher(Watcher &&) = delete;
+  Watcher &operator=(Watcher &&) = delete;
+
+  void Run() {
+    alignas(inotify_event) static char buf[65536];
+    for (;;) {
+      if (dirty) {
+        const auto left = chrono::ceil<chrono::milliseconds>(
+            dirty_since + MAX_DELAY - chrono::steady_clock::now());
+        int ready = 0;
+        if (left.count() > 0) {
+          pollfd pfd{.fd = inotify, .events = POLLIN, .revents = 0};
+          ready = poll(&pfd, 1, static_cast<int>(min(QUIET, left).count()));
+          if (ready < 0 && errno != EINTR)
+            abort();
+        }
+        if (!ready) {
+          Write();
+          dirty = false;
+          cout << "Updated " WORK_FILE_NAME << endl;
+          continue;
+        }
+      }
+      const ssize_t len = read(inotify, buf, sizeof(buf));
+      if (len < 0) {
+        if (errno == EINTR)
+          continue;
+        abort();
+      }
+      for (ssize_t i = 0; i < len;) {
+        const auto &event = *reinterpret_cast<const inotify_event *>(buf + i);
+        if (!Handle(event))
+          return;
+        if (!dirty)
+          dirty_since = chrono::steady_clock::now();
+        dirty = true;
+        i += static_cast<ssize_t>(sizeof(inotify_event) + event.len);
+      }
+    }
+  }
+};
+
 } // namespace
 
-int main() {
+int main(int argc, char *argv[]) {
+  bool watch = false, report = false, stream = false, margin = false;
+  bool unknown = false;
+  const char *profile_path = nullptr;
+  size_t inline_limit = 0;
+  bool loaded_modules = false;
+  BackgroundOptions background{};
+  for (int i = 1; i < argc; ++i) {
+    const string_view arg{argv[i]};
+    if (ParseBackgroundArg(arg, background))
+      continue;
+    if (arg == "--watch") {
+      watch = true;
+    } else if (arg == "--report") {
+      report = true;
+    } else if (arg == "--stream") {
+      stream = true;
+    } else if (arg == "--margin") {
+      margin = true;
+    } else if (arg.starts_with("--profile=")) {
+      profile_path = argv[i] + "--profile="sv.size();
+    } else if (arg == "--loaded-modules") {
+      loaded_modules = true;
+    } else if (arg.starts_with("--inline=")) {
+      inline_limit = strtoul(argv[i] + "--inline="sv.size(), nullptr, 10);
+      unknown |= !inline_limit || inline_limit > MAX_INLINE;
+    } else {
+      unknown = true;
+    }
+  }
+  if (unknown || watch + report + stream > 1 ||
+      ((profile_path || inline_limit || loaded_modules) && (watch || stream)) ||
+      (margin && !profile_path)) {
+    puts("Usage: gather_file_info [--watch | --report | --stream] "
+         "[--profile=" PROFILE_FILE_NAME " [--margin]] [--inline=bytes] "
+         "[--loaded-modules] " BACKGROUND_USAGE
+         "\n--inline= takes at most 1048576 bytes");
+    return 1;
+  }
+  // stdout carries the BOM when streaming
+  FILE *const messages = stream ? stderr : stdout;
   if (getuid()) {
-    puts("Warning: without root some restricted files may be skipped");
+    fputs("Warning: without root some restricted files may be skipped\n",
+          messages);
   }
   if (!filesystem::is_directory("config")) {
-    puts("Configuration is missing. Consider copying config_example to config");
+    fputs("Configuration is missing. Consider copying config_example to "
+          "config\n",
+          messages);
     return 1;
   }
   if (!filesystem::is_directory("/var/lib/dpkg")) {
-    puts("Expected a Debian-like system with /var/lib/dpkg");
+    fputs("Expected a Debian-like system with /var/lib/dpkg\n", messages);
+    return 1;
+  }
+  if (profile_path && !filesystem::is_regular_file(profile_path)) {
+    puts("Profile missing. Record one with ./record first");
     return 1;
   }
-  Run();
-  return 0;
+  // Room for the package databases in the page cache, and for us. Walking
+  // them is only worth it when there is a cgroup to apply the limit to.
+  if (background.cgroup && !background.memory_high)
+    background.memory_high = PackageDatabaseSize() + (256ul << 20);
+  EnterBackground(background);
+  throttle.Start(background);
+  const auto done = [messages] {
+    if (throttle.Active())
+      fprintf(messages, "Throttling held the gather back %lld ms\n",
+              static_cast<long long>(throttle.Delay().count()));
+    return 0;
+  };
+  if (stream) {
+    Stream();
+    return done();
+  }
+  if (profile_path) {
+    const vector<string> lines{LoadFileLines<false>(profile_path)};
+    const Profile profile{
+        .paths{lines.begin(), lines.end()},
+        .margin = margin,
+    };
+    Run(report, &profile, inline_limit, loaded_modules);
+    return done();
+  }
+  if (!watch) {
+    Run(report, nullptr, inline_limit, loaded_modules);
+    return done();
+  }
+  for (;;) {
+    Watcher watcher{};
+    watcher.Run();
+    puts("Configuration changed, reloading");
+  }
 }
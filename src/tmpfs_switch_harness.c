@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+#include "tmpfs_switch_init.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/loop.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs tmpfs_switch_init as pid 1 of fresh pid/mount/uts namespaces over a
+// throwaway tmpfs root, with a pty as its console, and times how long it
+// takes to reach the work shell. In return mode it lets the work shell exit
+// with a return requested and checks that a scratch disk's init takes over.
+
+#define INIT_BIN_NAME "tmpfs_switch_init_harness"
+#define ROOT_DIR "/tmp/tmpfs_switch_harness"
+#define TIMEOUT_MS 60000
+
+// The scratch disk for return mode, with a copy of the harness as its init
+#define DISK_IMAGE "/tmp/tmpfs_switch_harness.img"
+#define DISK_STAGING "/tmp/tmpfs_switch_harness.disk"
+#define DISK_SIZE (16 << 20)
+#define DISK_INIT_GREETING "disk init reached"
+
+static void copy_init(int input, const char *dest) {
+  const int output =
+      open(dest, O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL, 0700);
+  if (input < 0 || output < 0)
+    abort();
+  char buf[65536];
+  for (ssize_t len; (len = read(input, buf, sizeof(buf)));) {
+    if (len < 0 || write(output, buf, len) != len)
+      abort();
+  }
+  if (close(input) || close(output))
+    abort();
+}
+
+static void write_file(const char *path, const char *content) {
+  const int fd = open(path, O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 || write(fd, content, strlen(content)) != (ssize_t)strlen(content) ||
+      close(fd))
+    abort();
+}
+
+// With an origin, the return is already requested and points at it
+static void populate_root(const char *console, dev_t origin) {
+  const int init = open(INIT_BIN_NAME, O_RDONLY | O_CLOEXEC);
+  if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL))
+    abort();
+  if ((mkdir(ROOT_DIR, 0700) && errno != EEXIST) ||
+      mount("none", ROOT_DIR, "tmpfs", MS_NOSUID, "mode=755"))
+    abort();
+  if (chdir(ROOT_DIR))
+    abort();
+  static const char *const FOLDERS[] = {
+      "dev",  "dev/pts", "dev/shm", "dev/mqueue", "mnt", "proc",
+      "root", "sys",     "tmp",     "usr",        "usr/sbin",
+  };
+  for (size_t i = 0; i < sizeof(FOLDERS) / sizeof(FOLDERS[0]); ++i) {
+    if (mkdir(FOLDERS[i], 0755))
+      abort();
+  }
+  static const char *const LINKS[][2] = {
+      {"usr/bin", "bin"},
+      {"usr/lib", "lib"},
+      {"usr/lib64", "lib64"},
+      {"usr/sbin", "sbin"},
+  };
+  for (size_t i = 0; i < sizeof(LINKS) / sizeof(LINKS[0]); ++i) {
+    if (symlink(LINKS[i][0], LINKS[i][1]))
+      abort();
+  }
+  copy_init(init, "usr/sbin/tmpfs_switch_init");
+  // Borrow the host's binaries and libraries read-only
+  static const char *const BINDS[] = {"bin", "lib", "lib64"};
+  for (size_t i = 0; i < sizeof(BINDS) / sizeof(BINDS[0]); ++i) {
+    char src[16], dest[16];
+    snprintf(src, sizeof(src), "/usr/%s", BINDS[i]);
+    snprintf(dest, sizeof(dest), "usr/%s", BINDS[i]);
+    if (access(src, F_OK))
+      continue;
+    if (mkdir(dest, 0755) || mount(src, dest, NULL, MS_BIND | MS_REC, NULL) ||
+        mount(NULL, dest, NULL, MS_REMOUNT | MS_BIND | MS_RDONLY, NULL))
+      abort();
+  }
+  if (mknod("dev/null", S_IFCHR | 0666, makedev(1, 3)) ||
+      mknod("dev/tty", S_IFCHR | 0666, makedev(5, 0)))
+    abort();
+  // The pty stands in for the VT the init expects
+  const int tty1 = open("dev/tty1", O_WRONLY | O_CLOEXEC | O_CREAT, 0600);
+  if (tty1 < 0 || close(tty1) ||
+      mount(console, "dev/tty1", NULL, MS_BIND, NULL))
+    abort();
+  if (origin) {
+    // What activate's record_origin would have written for the disk. The
+    // return mounts by number, the source is only for messages.
+    char line[64];
+    snprintf(line, sizeof(line), "%u:%u ext2 / /dev/harness_disk\n",
+             major(origin), minor(origin));
+    write_file(ORIGIN_FILE, line);
+    write_file(RETURN_MARKER, "");
+    // Input typed ahead of the prompt is dropped, so the shell leaves itself
+    write_file("root/.bashrc", "exit\n");
+  }
+}
+
+static void run_mkfs(void) {
+  const pid_t pid = fork();
+  if (pid < 0)
+    abort();
+  if (!pid) {
+    execl("/sbin/mkfs.ext2", "mkfs.ext2", "-q", "-F", "-d", DISK_STAGING,
+          DISK_IMAGE, NULL);
+    abort();
+  }
+  int wstatus;
+  if (waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus) ||
+      WEXITSTATUS(wstatus))
+    abort();
+}
+
+// Builds the scratch disk and attaches it to a loop device that detaches
+// itself once the harness and the init's mount let go. Returns the loop fd.
+static int prepare_disk(dev_t *dev) {
+  // The return insists on a few directories besides /sbin/init
+  static const char *const FOLDERS[] = {"", "/dev", "/proc", "/sbin", "/sys"};
+  static const size_t FOLDER_COUNT = sizeof(FOLDERS) / sizeof(FOLDERS[0]);
+  char path[64];
+  for (size_t i = 0; i < FOLDER_COUNT; ++i) {
+    snprintf(path, sizeof(path), DISK_STAGING "%s", FOLDERS[i]);
+    if (mkdir(path, 0755))
+      abort();
+  }
+  copy_init(open("/proc/self/exe", O_RDONLY | O_CLOEXEC),
+            DISK_STAGING "/sbin/init");
+  const int image =
+      open(DISK_IMAGE, O_RDWR | O_CLOEXEC | O_CREAT | O_EXCL, 0600);
+  if (image < 0 || ftruncate(image, DISK_SIZE))
+    abort();
+  run_mkfs();
+  if (unlink(DISK_STAGING "/sbin/init"))
+    abort();
+  for (size_t i = FOLDER_COUNT; i--;) {
+    snprintf(path, sizeof(path), DISK_STAGING "%s", FOLDERS[i]);
+    if (rmdir(path))
+      abort();
+  }
+  const int control = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+  if (control < 0)
+    abort();
+  int loop = -1;
+  // Another user may take the free device first
+  while (loop < 0) {
+    const int index = ioctl(control, LOOP_CTL_GET_FREE);
+    if (index < 0)
+      abort();
+    snprintf(path, sizeof(path), "/dev/loop%d", index);
+    loop = open(path, O_RDWR | O_CLOEXEC);
+    if (loop < 0)
+      abort();
+    if (ioctl(loop, LOOP_SET_FD, image)) {
+      if (errno != EBUSY)
+        abort();
+      (void)close(loop);
+      loop = -1;
+    }
+  }
+  static const struct loop_info64 info = {.lo_flags = LO_FLAGS_AUTOCLEAR};
+  struct stat st;
+  if (ioctl(loop, LOOP_SET_STATUS64, &info) || fstat(loop, &st) ||
+      close(control) || close(image) || unlink(DISK_IMAGE))
+    abort();
+  *dev = st.st_rdev;
+  return loop;
+}
+
+static void spawn_population(unsigned int processes) {
+  for (unsigned int i = 0; i < processes; ++i) {
+    const pid_t pid = fork();
+    if (pid < 0)
+      abort();
+    if (!pid) {
+      for (;;)
+        pause();
+    }
+  }
+}
+
+_Noreturn static void run_init(const char *console, unsigned int processes,
+                               dev_t origin, int report) {
+  if (unshare(CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWUTS))
+    abort();
+  static const char hostname[] = "tmpfs-switch-harness";
+  if (sethostname(hostname, sizeof(hostname) - 1))
+    abort();
+  populate_root(console, origin);
+  const pid_t pid = fork();
+  if (pid < 0)
+    abort();
+  if (pid) {
+    if (write(report, &pid, sizeof(pid)) != sizeof(pid))
+      abort();
+    int wstatus;
+    (void)waitpid(pid, &wstatus, 0);
+    _exit(0);
+  }
+  if (close(report) || syscall(SYS_pivot_root, ".", ".") ||
+      umount2(".", MNT_DETACH) || chdir("/"))
+    abort();
+  spawn_population(processes);
+  if (setsid() < 0)
+    abort();
+  const int tty = open("/dev/tty1", O_RDWR);
+  if (tty < 0 || ioctl(tty, TIOCSCTTY, 0) || dup2(tty, 0) || dup2(tty, 1) != 1 ||
+      dup2(tty, 2) != 2 || close(tty))
+    abort();
+  static const char *const argv[] = {"/sbin/tmpfs_switch_init", NULL};
+  static const char *const envp[] = {NULL};
+  execve(argv[0], (char *const *)argv, (char *const *)envp);
+  abort();
+}
+
+static long elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now))
+    abort();
+  return (now.tv_sec - start->tv_sec) * 1000 +
+         (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Returns which needle showed up first, or -1 on timeout
+static int wait_output(int master, const struct timespec *start,
+                       const char *const *needles, size_t count) {
+  size_t longest = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (strlen(needles[i]) > longest)
+      longest = strlen(needles[i]);
+  }
+  char buf[4096 + 64];
+  if (longest >= 64)
+    abort();
+  size_t kept = 0;
+  for (long rem; (rem = TIMEOUT_MS - elapsed_ms(start)) > 0;) {
+    struct pollfd pfd = {.fd = master, .events = POLLIN};
+    if (poll(&pfd, 1, (int)rem) < 0 && errno != EINTR)
+      abort();
+    const ssize_t len = read(master, buf + kept, sizeof(buf) - 1 - kept);
+    if (len <= 0) {
+      // The init hangs up the console while moving between ttys
+      static const struct timespec backoff = {.tv_nsec = 1000000};
+      nanosleep(&backoff, NULL);
+      continue;
+    }
+    kept += len;
+    buf[kept] = '\0';
+    for (size_t i = 0; i < count; ++i) {
+      if (memmem(buf, kept, needles[i], strlen(needles[i])))
+        return (int)i;
+    }
+    if (kept > longest) {
+      memmove(buf, buf + kept - longest, longest);
+      kept = longest;
+    }
+  }
+  return -1;
+}
+
+struct run {
+  int master;
+  int slave;
+  pid_t helper;
+  pid_t init;
+  struct timespec start;
+};
+
+static void start_run(struct run *run, unsigned int processes, dev_t origin) {
+  // Nonblocking so that a hangup can't hold a read past the timeout
+  run->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK);
+  if (run->master < 0 || grantpt(run->master) || unlockpt(run->master))
+    abort();
+  const char *console = ptsname(run->master);
+  if (!console)
+    abort();
+  // Keep the slave open so hangups by the init don't make the master EOF
+  run->slave = open(console, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  int report[2];
+  if (run->slave < 0 || pipe2(report, O_CLOEXEC))
+    abort();
+  if (clock_gettime(CLOCK_MONOTONIC, &run->start))
+    abort();
+  run->helper = fork();
+  if (run->helper < 0)
+    abort();
+  if (!run->helper) {
+    if (close(report[0]))
+      abort();
+    run_init(console, processes, origin, report[1]);
+  }
+  if (close(report[1]) ||
+      read(report[0], &run->init, sizeof(run->init)) != sizeof(run->init) ||
+      close(report[0]))
+    abort();
+}
+
+static void end_run(struct run *run) {
+  // Killing pid 1 of the namespace takes everything else down with it
+  (void)kill(run->init, SIGKILL);
+  int wstatus;
+  if (waitpid(run->helper, &wstatus, 0) != run->helper || close(run->slave) ||
+      close(run->master))
+    abort();
+}
+
+// Returns the time to the work shell, or -1 on timeout
+static long run_once(unsigned int processes) {
+  struct run run;
+  start_run(&run, processes, 0);
+  static const char *const needles[] = {"work shell"};
+  const long ms = wait_output(run.master, &run.start, needles, 1) < 0
+                      ? -1
+                      : elapsed_ms(&run.start);
+  end_run(&run);
+  return ms;
+}
+
+// Lets the work shell exit with a return requested and reports whether the
+// disk's init took over or the init logged why not
+static int run_return(void) {
+  dev_t origin;
+  const int loop = prepare_disk(&origin);
+  struct run run;
+  start_run(&run, 16, origin);
+  static const char *const shell[] = {"work shell"};
+  int result = wait_output(run.master, &run.start, shell, 1);
+  long ms = -1;
+  if (result >= 0) {
+    struct timespec exited;
+    if (clock_gettime(CLOCK_MONOTONIC, &exited))
+      abort();
+    static const char *const outcomes[] = {DISK_INIT_GREETING,
+                                           "return failed"};
+    result = wait_output(run.master, &exited, outcomes, 2);
+    ms = elapsed_ms(&exited);
+  }
+  end_run(&run);
+  if (close(loop))
+    abort();
+  switch (result) {
+  case 0:
+    printf("returned to the disk init %ld ms after the work shell\n", ms);
+    return 0;
+  case 1:
+    puts("the init logged that the return failed");
+    return 1;
+  default:
+    puts("return timed out");
+    return 1;
+  }
+}
+
+static int compare_long(const void *a, const void *b) {
+  const long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+  // Running as the scratch disk's init at the end of return mode
+  if (getpid() == 1) {
+    puts(DISK_INIT_GREETING);
+    return 0;
+  }
+  const bool return_mode = argc > 1 && !strcmp(argv[1], "return");
+  const unsigned int runs = argc > 1 && !return_mode ? atoi(argv[1]) : 5;
+  const unsigned int processes = argc > 2 ? atoi(argv[2]) : 256;
+  if (getuid()) {
+    puts("Root is required to create namespaces");
+    return 1;
+  }
+  if (access(INIT_BIN_NAME, X_OK)) {
+    puts("./" INIT_BIN_NAME " is missing");
+    return 1;
+  }
+  if (!runs || runs > 1000 || (return_mode && argc > 2)) {
+    puts("Usage: tmpfs_switch_harness [runs] [processes] | return");
+    return 1;
+  }
+  if (return_mode)
+    return run_return();
+  long results[1000];
+  for (unsigned int i = 0; i < runs; ++i) {
+    results[i] = run_once(processes);
+    if (results[i] < 0) {
+      printf("run %u timed out\n", i);
+      return 1;
+    }
+    printf("run %u %ld ms\n", i, results[i]);
+  }
+  qsort(results, runs, sizeof(results[0]), compare_long);
+  printf("work shell after min %ld ms median %ld ms max %ld ms\n", results[0],
+         results[runs / 2], results[runs - 1]);
+  return 0;
+}
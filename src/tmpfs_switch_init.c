@@ -2,20 +2,52 @@
 #include "tmpfs_switch_init.h"
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mount.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <unistd.h>
 
-static void maybe_activate(bool argc1, const char *arg0) {
+// Returns false if the copier went away before finishing the bulk tier
+static bool wait_ready(void) {
+  while (access(TARGET_DIR "/" READY_MARKER, F_OK)) {
+    char progress[8];
+    const int fd = open(TARGET_DIR "/" PROGRESS_FILE, O_RDONLY | O_CLOEXEC);
+    ssize_t len = fd < 0 ? -1 : read(fd, progress, sizeof(progress) - 1);
+    // build_ramdisk holds the lock until it has marked the target ready
+    const bool dead = fd >= 0 && !flock(fd, LOCK_SH | LOCK_NB) &&
+                      access(TARGET_DIR "/" READY_MARKER, F_OK);
+    if (fd >= 0)
+      (void)close(fd);
+    if (dead) {
+      puts("The bulk tier copy stopped, see build_ramdisk's output");
+      return false;
+    }
+    if (len <= 0) {
+      strcpy(progress, "  ?%\n");
+      len = 5;
+    }
+    progress[len] = '\0';
+    printf("Waiting for the bulk tier %s", progress);
+    fflush(stdout);
+    print_sleep1_error(sleep1());
+  }
+  return true;
+}
+
+static bool is_command(const char *arg0, const char *name) {
   const char *basename = strrchr(arg0, '/');
-  if (strcmp("activate", basename ? basename + 1 : arg0) != 0) {
+  return !strcmp(name, basename ? basename + 1 : arg0);
+}
+
+static void maybe_activate(bool argc1, const char *arg0) {
+  if (!is_command(arg0, "activate")) {
     puts("Must run as pid 1");
     return;
   }
@@ -42,6 +74,14 @@ static void maybe_activate(bool argc1, const char *arg0) {
     puts("New root is not a mountpoint");
     return;
   }
+  if (access(TARGET_DIR "/" CRITICAL_MARKER, F_OK)) {
+    puts("New root lacks the critical tier");
+    return;
+  }
+  if (!wait_ready())
+    return;
+  record_origin();
+  timeline_stamp_activate();
   execl("/bin/systemctl", "systemctl", "switch-root", "/cdrom",
         "/sbin/tmpfs_switch_init", NULL);
   abort();
@@ -56,25 +96,30 @@ const char *init_environ[] = {
     // usrmerge, and don't care about local
     "PATH=/sbin:/bin",
     "PWD=/",
+    NULL,
 };
 
 static void setup_env() {
   if (mkdir("/root", 0700) && errno != EEXIST) {
-    puts("mkdir root failed");
+    log_msg(LOG_LEVEL_WARNING, "mkdir root failed");
     environ[0] = "HOME=/";
   }
   if (clearenv() || chdir("/"))
     abort();
 }
 
-static void try_mount(const char *mountpoint, const char *type) {
+static void try_mount(const char *mountpoint, const char *type,
+                      bool required) {
   assert(mountpoint[0] == '/' && mountpoint[1] && type[0]);
   (void) umount2(mountpoint, MNT_FORCE | MNT_DETACH);
   unsigned long flags = MS_NOSUID | MS_NOEXEC | MS_NOATIME;
   if (mountpoint[1] != 'd')
     flags |= MS_NODEV;
-  if (mount("none", mountpoint, type, flags, NULL))
+  if (!mount("none", mountpoint, type, flags, NULL))
+    return;
+  if (required)
     abort();
+  log_msg(LOG_LEVEL_WARNING, "mount %s failed", type);
 }
 
 static void mount_normal(void) {
@@ -96,7 +141,8 @@ static void mount_normal(void) {
       {"/sys", "sysfs"},
   };
   for (size_t i = sizeof(MOUNTPOINTS) / sizeof(MOUNTPOINTS[1]); i--;) {
-    try_mount(MOUNTPOINTS[i][0], MOUNTPOINTS[i][1]);
+    // Not every kernel has every filesystem
+    try_mount(MOUNTPOINTS[i][0], MOUNTPOINTS[i][1], false);
   }
 }
 
@@ -110,19 +156,31 @@ int main(int argc, char *argv[]) {
     return 1;
   }
   if (getpid() != 1) {
-    maybe_activate(argc == 1, *argv);
+    if (is_command(*argv, "return"))
+      request_return();
+    else if (is_command(*argv, "record"))
+      record_access(argc, argv);
+    else
+      maybe_activate(argc == 1, *argv);
     return 1;
   }
+  timeline_load_activate();
+  timeline_mark("entry");
   (void)unlink("/activate");
-  sync();
-  const enum sleep1_error sleep1_error = sleep1();
-  try_mount("/dev", "devtmpfs");
+  // flush_mounts needs mountinfo, or it falls back to a host-wide sync
+  try_mount("/proc", "proc", true);
+  flush_mounts();
+  timeline_mark("sync");
+#ifndef TMPFS_SWITCH_HARNESS
+  try_mount("/dev", "devtmpfs", true);
+#endif
+  timeline_mark("devtmpfs");
   activate_tty_early();
-  printf("tmpfs_switch_init with argc %d\n", argc);
+  timeline_mark("tty early");
+  log_msg(LOG_LEVEL_INFO, "tmpfs_switch_init with argc %d", argc);
   for (int i = 0; i < argc; ++i) {
-    puts(argv[i]);
+    log_msg(LOG_LEVEL_INFO, "%s", argv[i]);
   }
-  print_sleep1_error(sleep1_error);
   {
     static const struct sigaction sa = {
         .sa_handler = SIG_DFL,
@@ -131,40 +189,46 @@ int main(int argc, char *argv[]) {
     if (sigaction(SIGCHLD, &sa, NULL))
       abort();
   }
-  if (reboot(RB_DISABLE_CAD) || signal(SIGHUP, SIG_IGN))
+#ifndef TMPFS_SWITCH_HARNESS
+  if (reboot(RB_DISABLE_CAD))
+    abort();
+#endif
+  if (signal(SIGHUP, SIG_IGN))
     abort();
-  try_mount("/proc", "proc");
   killall5();
+  timeline_mark("killall5");
   setup_env();
+  timeline_mark("setup_env");
   mount_normal();
-  sync();
+  timeline_mark("mount_normal");
+  flush_mounts();
+  timeline_mark("resync");
   if (signal(SIGCHLD, SIG_DFL))
     abort();
-  print_sleep1_error(sleep1());
   release_tty();
+  timeline_mark("release_tty");
   activate_tty_late();
-  puts("work shell");
+  timeline_mark("tty late");
+  timeline_dump();
+  log_msg(LOG_LEVEL_INFO, "work shell");
+  // The switch is done, so the console can take its time
+  log_drain();
   const char *const bash_argv[] = {
       "bash",
       NULL,
   };
-  const pid_t work_pid = fork_exec_tty(false, "/bin/bash", bash_argv);
-  for (;;) {
-    const pid_t lost_pid = wait(NULL);
-    if (lost_pid <= 1) {
-      if (errno != EINTR)
-        abort();
-      continue;
-    }
-    if (lost_pid == work_pid)
-      break;
-  }
+  watch_work_shell(fork_exec_tty(false, "/bin/bash", bash_argv));
   activate_tty_late();
-  puts("work done");
-  print_sleep1_error(sleep1());
+  log_msg(LOG_LEVEL_INFO, "work done");
   killall5();
+  if (return_requested()) {
+    flush_mounts();
+    return_to_disk();
+    log_msg(LOG_LEVEL_ERROR, "return failed");
+  }
   disallocate_ttys();
-  puts("exec shell");
+  log_msg(LOG_LEVEL_INFO, "exec shell");
+  log_drain();
   fork_exec_tty(true, "/bin/bash", bash_argv);
   abort();
 }
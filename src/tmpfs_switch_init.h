@@ -4,10 +4,110 @@
 #include <stdbool.h>
 #include <sys/types.h>
 
+// Written by activate just before switch-root, read back by pid 1
+#define ACTIVATE_STAMP ".tmpfs_switch_activate"
+// Timeline of the switch, written to the new root
+#define TIMELINE_FILE "tmpfs_switch_timeline.txt"
+
+// Device, type, root and source of the disk root, written by activate into
+// the new root
+#define ORIGIN_FILE ".tmpfs_switch_origin"
+// Created by the return command, checked once the work shell exits
+#define RETURN_MARKER ".tmpfs_switch_return"
+
+// Runs a command, or a shell, and appends every file it or its descendants
+// open to the profile
+void record_access(int argc, char *argv[]);
+
+// A nonblocking socket of the process events connector, or -1 without one
+int open_proc_events(void);
+
+void record_origin(void);
+
+void request_return(void);
+
+bool return_requested(void);
+
+// Only returns if the disk root could not be switched to
+void return_to_disk(void);
+
+enum log_level {
+  LOG_LEVEL_ERROR = 3,
+  LOG_LEVEL_WARNING = 4,
+  LOG_LEVEL_INFO = 6,
+  // Per-process detail, only counted when too much of it comes at once
+  LOG_LEVEL_VERBOSE = 7,
+};
+
+// Everything the init logged, written to the new root
+#define LOG_FILE "tmpfs_switch_init.log"
+
+// Buffers a line for the console, the serial console and the log file.
+// Warnings and errors also go to /dev/kmsg straight away, and errors flush
+// the buffer, blocking until the console has taken it.
+void log_msg(enum log_level level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Writes out as much of the buffer as each output takes without blocking
+void log_flush(void);
+
+// Writes out all of the buffer, blocking until each output has taken it. For
+// when nothing waits on the switch any more, or the buffer is about to go.
+void log_drain(void);
+
+// Also flushes the log, as step boundaries are where it goes out
+void timeline_mark(const char *name);
+
+void timeline_stamp_activate(void);
+
+void timeline_load_activate(void);
+
+void timeline_dump(void);
+
 void release_tty(void);
 
+// How long killall5 waits for processes to exit after SIGTERM
+#ifndef TERM_TIMEOUT_MS
+#define TERM_TIMEOUT_MS 1000
+#endif
+// How long killall5 waits for processes to exit after SIGKILL
+#ifndef KILL_TIMEOUT_MS
+#define KILL_TIMEOUT_MS 200
+#endif
+
+// How long flush_mounts waits for syncfs on all mounts
+#ifndef SYNC_TIMEOUT_MS
+#define SYNC_TIMEOUT_MS 10000
+#endif
+
+// syncfs on each disk-backed mount concurrently, plus a sync() when the
+// origin isn't among them, bounded by SYNC_TIMEOUT_MS
+void flush_mounts(void);
+
+// Hands each userspace process other than init to visit
+void for_each_process(int procfs,
+                      void (*visit)(int procfs, pid_t pid, const char *d_name));
+
+// Prints each userspace process other than init and hands it to victim
+void scan_processes(int procfs, bool term,
+                    void (*victim)(pid_t pid, const char *name, bool term));
+
 void killall5();
 
+// How long memory must stall within 2 s to count as pressure
+#ifndef PRESSURE_STALL_MS
+#define PRESSURE_STALL_MS 200
+#endif
+// Minimum time between two watchdog warnings
+#ifndef PRESSURE_WARN_INTERVAL_MS
+#define PRESSURE_WARN_INTERVAL_MS 10000
+#endif
+
+// Reaps children until the work shell exits, warning about memory pressure
+// and a filling root on the way. Whatever the shell starts is moved ahead of
+// it for the OOM killer as it forks.
+void watch_work_shell(pid_t work_pid);
+
 enum sleep1_error {
   SLEEP1_ERROR_NONE = 0,
   SLEEP1_ERROR_GET = 1,
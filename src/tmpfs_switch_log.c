@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include "tmpfs_switch_init.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Lines wait here until a step boundary and then go out without blocking, so
+// a slow VT or a 38400 baud serial line never holds up the switch. Errors are
+// the exception: an abort usually follows, so they go out at once. Once the
+// work shell is up, or before an exec, log_drain waits for the slow outputs.
+
+#define LOG_RING_SIZE 65536
+// Verbose lines shown between two flushes before they are only counted
+#define LOG_VERBOSE_BURST 32
+
+enum log_sink {
+  LOG_SINK_CONSOLE,
+  LOG_SINK_SERIAL,
+  LOG_SINK_FILE,
+  LOG_SINKS,
+};
+
+static char ring[LOG_RING_SIZE]; // this init is not threaded
+static unsigned long head;
+static unsigned long tails[LOG_SINKS];
+static unsigned long dropped[LOG_SINKS];
+static unsigned int verbose_shown, verbose_suppressed;
+
+static void flush(bool block);
+
+static void ring_append(const char *text, size_t len) {
+  for (size_t i = 0; i < LOG_SINKS; ++i) {
+    // Outputs a whole ring behind lose their oldest bytes
+    if (head + len - tails[i] > LOG_RING_SIZE) {
+      const unsigned long lost = head + len - LOG_RING_SIZE - tails[i];
+      dropped[i] += lost;
+      tails[i] += lost;
+    }
+  }
+  const size_t offset = head % LOG_RING_SIZE;
+  const size_t first =
+      len < LOG_RING_SIZE - offset ? len : LOG_RING_SIZE - offset;
+  memcpy(ring + offset, text, first);
+  memcpy(ring, text + first, len - first);
+  head += len;
+}
+
+void log_msg(enum log_level level, const char *format, ...) {
+  if (level == LOG_LEVEL_VERBOSE && verbose_shown++ >= LOG_VERBOSE_BURST) {
+    ++verbose_suppressed;
+    return;
+  }
+  char line[512];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line) - 1, format, args);
+  va_end(args);
+  if (len < 0)
+    return;
+  if ((size_t)len > sizeof(line) - 2)
+    len = sizeof(line) - 2;
+  line[len++] = '\n';
+  ring_append(line, len);
+  if (level > LOG_LEVEL_WARNING)
+    return;
+  const int kmsg = open("/dev/kmsg", O_WRONLY | O_CLOEXEC | O_NOCTTY);
+  if (kmsg >= 0) {
+    (void)dprintf(kmsg, "<%d>tmpfs_switch_init: %.*s", level, len, line);
+    (void)close(kmsg);
+  }
+  if (level == LOG_LEVEL_ERROR)
+    flush(true);
+}
+
+static void flush_sink(enum log_sink sink, int fd) {
+  if (dropped[sink]) {
+    char note[64];
+    const int len = snprintf(note, sizeof(note), "\n[%lu bytes of log lost]\n",
+                             dropped[sink]);
+    if (write(fd, note, len) != len)
+      return;
+    dropped[sink] = 0;
+  }
+  while (tails[sink] != head) {
+    const size_t offset = tails[sink] % LOG_RING_SIZE;
+    const size_t pending = head - tails[sink];
+    const ssize_t len =
+        write(fd, ring + offset,
+              pending < LOG_RING_SIZE - offset ? pending
+                                               : LOG_RING_SIZE - offset);
+    if (len < 0 && errno == EINTR)
+      continue;
+    // Full or gone, the rest waits for the next flush
+    if (len <= 0)
+      return;
+    tails[sink] += len;
+  }
+}
+
+// The tty may be shared, so it is only non-blocking for the duration
+static void flush_tty(enum log_sink sink, int fd, bool block) {
+  if (block) {
+    flush_sink(sink, fd);
+    return;
+  }
+  const int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 ||
+      (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK))) {
+    tails[sink] = head;
+    return;
+  }
+  flush_sink(sink, fd);
+  if (!(flags & O_NONBLOCK))
+    (void)fcntl(fd, F_SETFL, flags);
+}
+
+static void flush(bool block) {
+  if (verbose_suppressed) {
+    const unsigned int suppressed = verbose_suppressed;
+    verbose_suppressed = 0;
+    log_msg(LOG_LEVEL_INFO, "... and %u more lines", suppressed);
+  }
+  verbose_shown = 0;
+  // Whatever was printed directly was meant to come first
+  fflush(stdout);
+  flush_tty(LOG_SINK_CONSOLE, 1, block);
+  // setup_tty points stderr at the serial console
+  struct stat console, serial;
+  if (!fstat(1, &console) && !fstat(2, &serial) && S_ISCHR(serial.st_mode) &&
+      serial.st_rdev != console.st_rdev)
+    flush_tty(LOG_SINK_SERIAL, 2, block);
+  else
+    tails[LOG_SINK_SERIAL] = head;
+  const int file = open("/" LOG_FILE,
+                        O_WRONLY | O_CLOEXEC | O_APPEND | O_CREAT | O_NOFOLLOW,
+                        0600);
+  if (file < 0) {
+    tails[LOG_SINK_FILE] = head;
+    return;
+  }
+  flush_sink(LOG_SINK_FILE, file);
+  (void)close(file);
+}
+
+void log_flush(void) { flush(false); }
+
+void log_drain(void) { flush(true); }
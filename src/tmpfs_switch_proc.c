@@ -2,12 +2,17 @@
 #include "tmpfs_switch_init.h"
 #include <assert.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -21,86 +26,185 @@ static pid_t str_to_pid(const char *c) {
   return pid;
 }
 
-static void handle_pid(int proc, pid_t pid, const char *d_name, bool term) {
-    {
-      const int maps = openat(proc, "maps", O_RDONLY | O_CLOEXEC);
-      if (maps < 0) {
+// Processes sent SIGTERM that haven't been seen to exit yet
+static struct pollfd victims[4096];
+static pid_t victim_pids[sizeof(victims) / sizeof(victims[0])];
+// argv[0], for naming those that need SIGKILL
+static char victim_names[sizeof(victims) / sizeof(victims[0])][128];
+static nfds_t victims_len;
+
+static void signal_pid(pid_t pid, const char *name, bool term) {
+  const int pidfd = pidfd_open(pid, 0);
+  if (pidfd < 0) {
+    // Out of descriptors under a low hard limit, so without waiting
+    if (errno == EMFILE)
+      (void)kill(pid, term ? SIGTERM : SIGKILL);
 #ifndef NDEBUG
-        printf("disappeared maps %s\n", d_name);
+    else
+      log_msg(LOG_LEVEL_VERBOSE, "disappeared pidfd %d", pid);
 #endif
-        return;
-      }
-      char ignore;
-      ssize_t len = read(maps, &ignore, 1);
-      if (len < 0) {
+    return;
+  }
+  (void)pidfd_send_signal(pidfd, term ? SIGTERM : SIGKILL, NULL, 0);
+  if (term && victims_len < sizeof(victims) / sizeof(victims[0])) {
+    victim_pids[victims_len] = pid;
+    snprintf(victim_names[victims_len], sizeof(victim_names[0]), "%s", name);
+    victims[victims_len++] = (struct pollfd){.fd = pidfd, .events = POLLIN};
+  } else if (close(pidfd)) {
 #ifndef NDEBUG
-        printf("unreadable maps %s\n", d_name);
+    log_msg(LOG_LEVEL_VERBOSE, "error closing pidfd %d", pid);
 #endif
-        len = 0;
-      }
-      if (close(maps)) {
+  }
+}
+
+static long elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now))
+    return LONG_MAX;
+  return (now.tv_sec - start->tv_sec) * 1000 +
+         (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Returns the number of victims still alive at the deadline
+static nfds_t wait_victims(long timeout_ms) {
+  struct timespec start;
+  if (clock_gettime(CLOCK_MONOTONIC, &start))
+    timeout_ms = 0;
+  nfds_t alive = 0;
+  for (nfds_t i = 0; i < victims_len; ++i)
+    alive += victims[i].fd >= 0;
+  for (long rem; alive && (rem = timeout_ms - elapsed_ms(&start)) > 0;) {
+    const int ready = poll(victims, victims_len, (int)rem);
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+      log_msg(LOG_LEVEL_ERROR, "poll error");
+      break;
+    }
+    for (nfds_t i = 0; i < victims_len; ++i) {
+      if (victims[i].fd < 0 || !victims[i].revents)
+        continue;
+      (void)close(victims[i].fd);
+      victims[i].fd = -1;
+      --alive;
+    }
+  }
+  return alive;
+}
+
+static void kill_victims(void) {
+  for (nfds_t i = 0; i < victims_len; ++i) {
+    if (victims[i].fd < 0)
+      continue;
+    log_msg(LOG_LEVEL_VERBOSE, "stubborn %d %s", victim_pids[i],
+            victim_names[i]);
+    (void)pidfd_send_signal(victims[i].fd, SIGKILL, NULL, 0);
+  }
+  (void)wait_victims(KILL_TIMEOUT_MS);
+  for (nfds_t i = 0; i < victims_len; ++i) {
+    if (victims[i].fd >= 0)
+      (void)close(victims[i].fd);
+  }
+  victims_len = 0;
+}
+
+// Not exported to userspace, see include/linux/sched.h
+#define PF_KTHREAD 0x00200000
+
+// Kernel threads and zombies are left alone
+static bool is_user_process(int procfs, const char *d_name) {
+  char path[32];
+  snprintf(path, sizeof(path), "%s/stat", d_name);
+  const int stat = openat(procfs, path, O_RDONLY | O_CLOEXEC);
+  if (stat < 0) {
 #ifndef NDEBUG
-        printf("error closing maps %s\n", d_name);
+    log_msg(LOG_LEVEL_VERBOSE, "disappeared stat %s", d_name);
 #endif
-      }
-      if (!len) {
-        // kernel thread
-        return;
-      }
-    }
-    {
-      const int cmdline = openat(proc, "cmdline", O_RDONLY | O_CLOEXEC);
-      if (cmdline < 0) {
+    return false;
+  }
+  // pid (comm) state ppid pgrp session tty_nr tpgid flags fit easily
+  char buf[256];
+  const ssize_t len = read(stat, buf, sizeof(buf) - 1);
+  if (close(stat)) {
 #ifndef NDEBUG
-        printf("disappeared cmdline %s\n", d_name);
+    log_msg(LOG_LEVEL_VERBOSE, "error closing stat %s", d_name);
 #endif
-        return;
-      }
-      char name[256];
-      ssize_t len = read(cmdline, &name, sizeof(name));
-      assert(len <= (ssize_t)sizeof(name));
-      if (len < 0) {
+  }
+  if (len <= 0) {
 #ifndef NDEBUG
-        printf("unreadable cmdline %s\n", d_name);
+    log_msg(LOG_LEVEL_VERBOSE, "unreadable stat %s", d_name);
 #endif
-      } else if (!len) {
-        printf("missing cmdline %s\n", d_name);
-        len = 1;
-      } else if (len == 1) {
-        if (!name[0]) {
-          printf("empty cmdline %s\n", d_name);
-        } else {
-          printf("corrupt empty cmdline %s\n", d_name);
-        }
-      } else if (len == sizeof(name) && !memchr(name, '\0', sizeof(name))) {
-        printf("oversized cmdline %s\n", d_name);
-      } else if (len != sizeof(name) && name[len - 1]) {
-        printf("corrupt cmdline %s\n", d_name);
-      } else {
-        len = 0;
-      }
-      if (close(cmdline)) {
+    return false;
+  }
+  buf[len] = '\0';
+  const char *comm_end = strrchr(buf, ')');
+  char state;
+  pid_t ppid;
+  unsigned int flags;
+  if (!comm_end ||
+      sscanf(comm_end + 1, " %c %d %*d %*d %*d %*d %u", &state, &ppid,
+             &flags) != 3) {
+    log_msg(LOG_LEVEL_VERBOSE, "corrupt stat %s", d_name);
+    return false;
+  }
+  return state != 'Z' && state != 'X' && ppid != 2 && !(flags & PF_KTHREAD);
+}
+
+static void handle_pid(int procfs, pid_t pid, const char *d_name, bool term,
+                       void (*victim)(pid_t pid, const char *name,
+                                      bool term)) {
+  char path[32];
+  snprintf(path, sizeof(path), "%s/cmdline", d_name);
+  const int cmdline = openat(procfs, path, O_RDONLY | O_CLOEXEC);
+  if (cmdline < 0) {
+#ifndef NDEBUG
+    log_msg(LOG_LEVEL_VERBOSE, "disappeared cmdline %s", d_name);
+#endif
+    return;
+  }
+  char name[256];
+  ssize_t len = read(cmdline, &name, sizeof(name));
+  assert(len <= (ssize_t)sizeof(name));
+  if (len < 0) {
 #ifndef NDEBUG
-        printf("error closing cmdline %s\n", d_name);
+    log_msg(LOG_LEVEL_VERBOSE, "unreadable cmdline %s", d_name);
 #endif
-      }
-      if (len)
-        return;
-      if (term) {
-        printf("remaining %s %s\n", d_name, name);
-        kill(pid, SIGTERM);
-      } else {
-        printf("stubborn %s %s\n", d_name, name);
-        kill(pid, SIGKILL);
-      }
+  } else if (!len) {
+    log_msg(LOG_LEVEL_VERBOSE, "missing cmdline %s", d_name);
+    len = 1;
+  } else if (len == 1) {
+    if (!name[0]) {
+      log_msg(LOG_LEVEL_VERBOSE, "empty cmdline %s", d_name);
+    } else {
+      log_msg(LOG_LEVEL_VERBOSE, "corrupt empty cmdline %s", d_name);
     }
+  } else if (len == sizeof(name) && !memchr(name, '\0', sizeof(name))) {
+    log_msg(LOG_LEVEL_VERBOSE, "oversized cmdline %s", d_name);
+  } else if (len != sizeof(name) && name[len - 1]) {
+    log_msg(LOG_LEVEL_VERBOSE, "corrupt cmdline %s", d_name);
+  } else {
+    len = 0;
+  }
+  if (close(cmdline)) {
+#ifndef NDEBUG
+    log_msg(LOG_LEVEL_VERBOSE, "error closing cmdline %s", d_name);
+#endif
+  }
+  if (len)
+    return;
+  log_msg(LOG_LEVEL_VERBOSE, "%s %s %s", term ? "remaining" : "stubborn",
+          d_name, name);
+  victim(pid, name, term);
 }
 
-static void kill_processes(int procfs, bool term) {
+void for_each_process(int procfs,
+                      void (*visit)(int procfs, pid_t pid, const char *d_name)) {
   static char buf[16384]; // this init is not threaded
+  if (lseek(procfs, 0, SEEK_SET))
+    abort();
   for (ssize_t end; (end = getdents64(procfs, buf, sizeof(buf)));) {
     if (!~end) {
-      puts("getdents error");
+      log_msg(LOG_LEVEL_ERROR, "getdents error");
       abort();
     }
     const struct dirent64 *entry;
@@ -110,42 +214,59 @@ static void kill_processes(int procfs, bool term) {
       if (entry->d_type != DT_DIR)
         continue;
       pid_t pid = str_to_pid(entry->d_name);
-      if (pid <= 1)
-        continue;
-      const int proc = openat(procfs, entry->d_name, O_CLOEXEC | O_DIRECTORY | O_PATH);
-      if (proc < 0) {
-#ifndef NDEBUG
-        printf("disappeared pid %s\n", entry->d_name);
-#endif
+      if (pid <= 1 || !is_user_process(procfs, entry->d_name))
         continue;
-      }
-      handle_pid(proc, pid, entry->d_name, term);
-      if (close(proc)) {
-#ifndef NDEBUG
-        printf("error closing pid %s\n", entry->d_name);
-#endif
-      }
+      visit(procfs, pid, entry->d_name);
     }
   }
 }
 
+static bool scan_term;
+static void (*scan_victim)(pid_t pid, const char *name, bool term);
+
+static void scan_pid(int procfs, pid_t pid, const char *d_name) {
+  handle_pid(procfs, pid, d_name, scan_term, scan_victim);
+}
+
+void scan_processes(int procfs, bool term,
+                    void (*victim)(pid_t pid, const char *name, bool term)) {
+  scan_term = term;
+  scan_victim = victim;
+  for_each_process(procfs, scan_pid);
+}
+
 void killall5(void) {
+  // Every victim holds a pidfd open. Only the soft limit is raised, and only
+  // for the scan, as whatever init execs later inherits it.
+  struct rlimit saved;
+  const bool raise = !getrlimit(RLIMIT_NOFILE, &saved);
+  if (raise) {
+    struct rlimit nofile = saved;
+    const rlim_t wanted = sizeof(victims) / sizeof(victims[0]) + 64;
+    if (nofile.rlim_cur < wanted)
+      nofile.rlim_cur = nofile.rlim_max < wanted ? nofile.rlim_max : wanted;
+    if (setrlimit(RLIMIT_NOFILE, &nofile))
+      log_msg(LOG_LEVEL_WARNING, "setrlimit error");
+  }
   const int procfs = open("/proc", O_CLOEXEC | O_DIRECTORY);
   if (procfs < 0)
     abort();
-  puts("sigterm");
-  kill_processes(procfs, true);
-  print_sleep1_error(sleep1());
-  puts("sigkill");
-  if (lseek(procfs, 0, SEEK_SET))
-    abort();
-  kill_processes(procfs, false);
+  log_msg(LOG_LEVEL_INFO, "sigterm");
+  scan_processes(procfs, true, signal_pid);
+  // Out while the victims are exiting
+  log_flush();
+  const nfds_t alive = wait_victims(TERM_TIMEOUT_MS);
+  log_msg(LOG_LEVEL_INFO, "sigkill %lu", (unsigned long)alive);
+  kill_victims();
+  scan_processes(procfs, false, signal_pid);
   if (close(procfs)) {
 #ifndef NDEBUG
-    puts("error closing procfs");
+    log_msg(LOG_LEVEL_VERBOSE, "error closing procfs");
 #endif
   }
-  puts("done killall5");
+  if (raise && setrlimit(RLIMIT_NOFILE, &saved))
+    log_msg(LOG_LEVEL_WARNING, "setrlimit error");
+  log_msg(LOG_LEVEL_INFO, "done killall5");
 }
 
 enum sleep1_error sleep1(void) {
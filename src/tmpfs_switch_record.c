@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include "tmpfs_switch_init.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/pidfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Paths already written, by hash. This command is not threaded.
+static uint64_t seen[1 << 16];
+static size_t seen_len;
+
+static bool first_sight(const char *path) {
+  uint64_t hash = 14695981039346656037ull;
+  for (const char *c = path; *c; ++c)
+    hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+  hash |= 1;
+  const size_t mask = sizeof(seen) / sizeof(seen[0]) - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    if (seen[i] == hash)
+      return false;
+    if (!seen[i]) {
+      // Past three quarters full, duplicates are left to gather_file_info
+      if (seen_len >= mask / 4 * 3)
+        return true;
+      seen[i] = hash;
+      ++seen_len;
+      return true;
+    }
+  }
+}
+
+// fanotify sees the whole host, so the command's processes are told apart by
+// following forks through the process events connector. Without it, every
+// open on the host is recorded.
+static bool everyone;
+// By tgid, up to the kernel's PID_MAX_LIMIT
+static uint64_t traced[(4 << 20) / 64];
+// Exits are only applied once the opens queued before them are recorded
+static pid_t exited[4096];
+static size_t exited_len;
+static bool events_lost;
+
+static bool is_traced(pid_t pid) {
+  return everyone || (pid > 0 && (size_t)pid < sizeof(traced) * 8 &&
+                      traced[pid / 64] & 1ull << pid % 64);
+}
+
+static void trace(pid_t pid, bool on) {
+  if (pid <= 0 || (size_t)pid >= sizeof(traced) * 8)
+    return;
+  if (on)
+    traced[pid / 64] |= 1ull << pid % 64;
+  else
+    traced[pid / 64] &= ~(1ull << pid % 64);
+}
+
+int open_proc_events(void) {
+  const int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                        NETLINK_CONNECTOR);
+  if (fd < 0)
+    return -1;
+  const struct sockaddr_nl addr = {
+      .nl_family = AF_NETLINK,
+      .nl_groups = CN_IDX_PROC,
+  };
+  static const enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+  char listen[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(op))]
+      __attribute__((aligned(NLMSG_ALIGNTO))) = {0};
+  struct nlmsghdr *nl = (struct nlmsghdr *)listen;
+  nl->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+  nl->nlmsg_type = NLMSG_DONE;
+  struct cn_msg *cn = NLMSG_DATA(nl);
+  cn->id.idx = CN_IDX_PROC;
+  cn->id.val = CN_VAL_PROC;
+  cn->len = sizeof(op);
+  memcpy(cn->data, &op, sizeof(op));
+  if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) ||
+      send(fd, listen, nl->nlmsg_len, 0) != (ssize_t)nl->nlmsg_len) {
+    (void)close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Forks are applied straight away, as they come before any open by the child
+static void drain_proc_events(int fd) {
+  if (fd < 0)
+    return;
+  static char buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+  for (ssize_t len;;) {
+    len = recv(fd, buf, sizeof(buf), 0);
+    if (len < 0 && errno == ENOBUFS) {
+      events_lost = true;
+      continue;
+    }
+    if (len <= 0)
+      return;
+    for (const struct nlmsghdr *nl = (const struct nlmsghdr *)buf;
+         NLMSG_OK(nl, (size_t)len); nl = NLMSG_NEXT(nl, len)) {
+      const struct cn_msg *cn = NLMSG_DATA(nl);
+      const struct proc_event *event = (const struct proc_event *)cn->data;
+      if (event->what == PROC_EVENT_FORK &&
+          is_traced(event->event_data.fork.parent_tgid)) {
+        trace(event->event_data.fork.child_tgid, true);
+      } else if (event->what == PROC_EVENT_EXIT &&
+                 event->event_data.exit.process_pid ==
+                     event->event_data.exit.process_tgid &&
+                 is_traced(event->event_data.exit.process_tgid) &&
+                 exited_len < sizeof(exited) / sizeof(exited[0])) {
+        exited[exited_len++] = event->event_data.exit.process_tgid;
+      }
+    }
+  }
+}
+
+// Opens of API filesystems say nothing about what the ramdisk needs
+static bool is_api_mount(const char *mountpoint) {
+  static const char *const API_MOUNTS[] = {"/dev", "/proc", "/run", "/sys"};
+  for (size_t i = 0; i < sizeof(API_MOUNTS) / sizeof(API_MOUNTS[0]); ++i) {
+    const size_t len = strlen(API_MOUNTS[i]);
+    if (!strncmp(mountpoint, API_MOUNTS[i], len) &&
+        (!mountpoint[len] || mountpoint[len] == '/'))
+      return true;
+  }
+  return false;
+}
+
+static size_t mark_mounts(int fanotify) {
+  FILE *mountinfo = fopen("/proc/self/mountinfo", "re");
+  if (!mountinfo)
+    return 0;
+  char *line = NULL;
+  size_t line_size = 0, marked = 0;
+  while (getline(&line, &line_size, mountinfo) > 0) {
+    char mountpoint[256];
+    if (sscanf(line, "%*d %*d %*u:%*u %*s %255s", mountpoint) != 1 ||
+        is_api_mount(mountpoint))
+      continue;
+    if (fanotify_mark(fanotify, FAN_MARK_ADD | FAN_MARK_MOUNT,
+                      FAN_OPEN | FAN_OPEN_EXEC, AT_FDCWD, mountpoint))
+      printf("Not recording %s\n", mountpoint);
+    else
+      ++marked;
+  }
+  free(line);
+  (void)fclose(mountinfo);
+  return marked;
+}
+
+static void record_event(const struct fanotify_event_metadata *event,
+                         FILE *profile) {
+  if (event->fd < 0)
+    return;
+  struct stat st;
+  char link[32], path[4096];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", event->fd);
+  const ssize_t len = readlink(link, path, sizeof(path) - 1);
+  if (is_traced(event->pid) && len > 0 && !fstat(event->fd, &st) &&
+      S_ISREG(st.st_mode)) {
+    path[len] = '\0';
+    if (path[0] == '/' && !strstr(path, " (deleted)") && first_sight(path))
+      fprintf(profile, "%s\n", path);
+  }
+  (void)close(event->fd);
+}
+
+void record_access(int argc, char *argv[]) {
+  const int fanotify = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC |
+                                         FAN_NONBLOCK,
+                                     O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+  if (fanotify < 0) {
+    printf("fanotify unavailable %d\n", errno);
+    return;
+  }
+  if (!mark_mounts(fanotify)) {
+    puts("No mounts to record");
+    return;
+  }
+  FILE *profile = fopen(PROFILE_FILE_NAME, "ae");
+  if (!profile)
+    abort();
+  // Listening before the fork, so no fork by the command goes unseen
+  const int proc_events = open_proc_events();
+  if (proc_events < 0) {
+    everyone = true;
+    puts("Process events unavailable, recording what every process on the "
+         "host opens");
+  }
+  static const char *const default_argv[] = {"/bin/bash", NULL};
+  const char *const *command =
+      argc > 1 ? (const char *const *)argv + 1 : default_argv;
+  printf("Recording file access to %s until %s exits\n", PROFILE_FILE_NAME,
+         command[0]);
+  fflush(stdout);
+  const pid_t pid = fork();
+  if (pid < 0)
+    abort();
+  if (!pid) {
+    execvp(command[0], (char *const *)command);
+    printf("exec %s failed\n", command[0]);
+    _exit(127);
+  }
+  trace(pid, true);
+  // The command owns the terminal while it runs
+  if (signal(SIGINT, SIG_IGN) == SIG_ERR || signal(SIGQUIT, SIG_IGN) == SIG_ERR)
+    abort();
+  struct pollfd fds[] = {
+      {.fd = fanotify, .events = POLLIN},
+      {.fd = pidfd_open(pid, 0), .events = POLLIN},
+      {.fd = proc_events, .events = POLLIN},
+  };
+  if (fds[1].fd < 0)
+    abort();
+  for (bool done = false; !done;) {
+    if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      abort();
+    }
+    // Drain what came before the exit too
+    done = fds[1].revents;
+    drain_proc_events(proc_events);
+    static char buf[65536];
+    for (ssize_t len; (len = read(fanotify, buf, sizeof(buf))) > 0;) {
+      // Whoever opened these forked before the open
+      drain_proc_events(proc_events);
+      const struct fanotify_event_metadata *event =
+          (const struct fanotify_event_metadata *)buf;
+      for (; FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+        if (event->vers == FANOTIFY_METADATA_VERSION)
+          record_event(event, profile);
+      }
+    }
+    // The queue is empty, so whatever the exited did before exiting is in
+    for (size_t i = 0; i < exited_len; ++i)
+      trace(exited[i], false);
+    exited_len = 0;
+  }
+  int wstatus;
+  if (waitpid(pid, &wstatus, 0) != pid || close(fds[1].fd) || close(fanotify) ||
+      (proc_events >= 0 && close(proc_events)) || fclose(profile))
+    abort();
+  if (events_lost)
+    puts("Some process events were lost, files opened by the processes they "
+         "announced may be missing");
+  printf("Recorded %zu files to %s\n", seen_len, PROFILE_FILE_NAME);
+}
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include "tmpfs_switch_init.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/reboot.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#define ORIGIN_DEV "/dev/tmpfs_switch_origin"
+#define ORIGIN_MNT "/mnt"
+
+void record_origin(void) {
+  FILE *mountinfo = fopen("/proc/self/mountinfo", "re");
+  if (!mountinfo) {
+    puts("mountinfo unavailable, return will not be possible");
+    return;
+  }
+  char *line = NULL;
+  size_t line_size = 0;
+  char origin[800] = "";
+  while (getline(&line, &line_size, mountinfo) > 0) {
+    unsigned int major, minor;
+    char root[256], mountpoint[256], fstype[32], source[256];
+    const char *fields = strstr(line, " - ");
+    if (!fields ||
+        sscanf(line, "%*d %*d %u:%u %255s %255s", &major, &minor, root,
+               mountpoint) != 4 ||
+        sscanf(fields, " - %31s %255s", fstype, source) != 2 ||
+        strcmp(mountpoint, "/"))
+      continue;
+    // btrfs and others report an anonymous device, the one to mount is the
+    // source. The last mount on / is the one in effect.
+    struct stat st;
+    if (!stat(source, &st) && S_ISBLK(st.st_mode)) {
+      major = major(st.st_rdev);
+      minor = minor(st.st_rdev);
+    }
+    snprintf(origin, sizeof(origin), "%u:%u %s %s %s\n", major, minor, fstype,
+             root, source);
+  }
+  free(line);
+  (void)fclose(mountinfo);
+  if (!origin[0]) {
+    puts("Root mount not found, return will not be possible");
+    return;
+  }
+  const int fd = open(TARGET_DIR "/" ORIGIN_FILE,
+                      O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 || write(fd, origin, strlen(origin)) != (ssize_t)strlen(origin) ||
+      close(fd))
+    abort();
+}
+
+void request_return(void) {
+  if (access("/" ORIGIN_FILE, F_OK)) {
+    puts("Not running from a tmpfs root with a known origin");
+    return;
+  }
+  const int fd = open("/" RETURN_MARKER,
+                      O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 || close(fd))
+    abort();
+  puts("Exit the work shell to return to the disk root");
+}
+
+bool return_requested(void) { return !access("/" RETURN_MARKER, F_OK); }
+
+// Checks the disk init the same way the kernel would resolve it as the root
+static bool has_init(int root) {
+  static const struct open_how how = {
+      .flags = O_PATH | O_CLOEXEC,
+      .resolve = RESOLVE_IN_ROOT,
+  };
+  const int init = (int)syscall(SYS_openat2, root, "sbin/init", &how,
+                                sizeof(how));
+  if (init < 0)
+    return false;
+  struct stat st;
+  const bool ok = !fstat(init, &st) && S_ISREG(st.st_mode) &&
+                  (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+  (void)close(init);
+  return ok;
+}
+
+static bool mount_origin(void) {
+  FILE *file = fopen("/" ORIGIN_FILE, "re");
+  if (!file) {
+    log_msg(LOG_LEVEL_ERROR, "origin unknown");
+    return false;
+  }
+  unsigned int major, minor;
+  char fstype[32], root[256], source[256];
+  const int fields = fscanf(file, "%u:%u %31s %255s %255s", &major, &minor,
+                            fstype, root, source);
+  (void)fclose(file);
+  if (fields != 5) {
+    log_msg(LOG_LEVEL_ERROR, "origin corrupt");
+    return false;
+  }
+  char data[272];
+  if (!strcmp(root, "/")) {
+    data[0] = '\0';
+  } else if (!strcmp(fstype, "btrfs")) {
+    snprintf(data, sizeof(data), "subvol=%s", root);
+  } else {
+    log_msg(LOG_LEVEL_ERROR, "origin is a bind mount, return is not supported");
+    return false;
+  }
+  const char *device;
+  if (major) {
+    // udev's names are gone with the disk's /dev, the number still holds
+    if (mknod(ORIGIN_DEV, S_IFBLK | 0600, makedev(major, minor)) &&
+        errno != EEXIST) {
+      log_msg(LOG_LEVEL_ERROR, "mknod origin failed %d", errno);
+      return false;
+    }
+    device = ORIGIN_DEV;
+  } else if (source[0] != '/' && strcmp(fstype, "overlay")) {
+    // Such as a ZFS dataset, named rather than backed by a device
+    device = source;
+  } else {
+    log_msg(LOG_LEVEL_ERROR, "origin %s on %s has no device to mount", fstype,
+            source);
+    return false;
+  }
+  (void)umount2(ORIGIN_MNT, MNT_DETACH);
+  if (mount(device, ORIGIN_MNT, fstype, 0, data[0] ? data : NULL)) {
+    log_msg(LOG_LEVEL_ERROR, "mount origin %s failed %d", source, errno);
+    return false;
+  }
+  return true;
+}
+
+void return_to_disk(void) {
+  log_msg(LOG_LEVEL_INFO, "return to disk");
+  log_flush();
+  if (!mount_origin())
+    return;
+  struct stat root, target;
+  if (lstat("/", &root) || lstat(ORIGIN_MNT, &target))
+    abort();
+  if (target.st_nlink < 5) {
+    log_msg(LOG_LEVEL_ERROR, "disk root lacks files");
+    return;
+  }
+  if (root.st_dev == target.st_dev) {
+    log_msg(LOG_LEVEL_ERROR, "disk root is not a mountpoint");
+    return;
+  }
+  const int mnt = open(ORIGIN_MNT, O_PATH | O_CLOEXEC | O_DIRECTORY);
+  if (mnt < 0)
+    abort();
+  const bool init = has_init(mnt);
+  (void)close(mnt);
+  if (!init) {
+    log_msg(LOG_LEVEL_ERROR, "disk root lacks /sbin/init");
+    return;
+  }
+  static const char *const API_MOUNTS[] = {"/dev", "/proc", "/sys"};
+  for (size_t i = 0; i < sizeof(API_MOUNTS) / sizeof(API_MOUNTS[0]); ++i) {
+    char dest[16];
+    snprintf(dest, sizeof(dest), ORIGIN_MNT "%s", API_MOUNTS[i]);
+    if (mount(API_MOUNTS[i], dest, NULL, MS_MOVE, NULL))
+      (void)umount2(API_MOUNTS[i], MNT_DETACH);
+  }
+  log_msg(LOG_LEVEL_INFO, "exec disk init");
+  // The log file stays behind in the tmpfs, and the buffer goes with exec
+  log_drain();
+  // Point of no return: stack the disk on top and detach the tmpfs
+  if (chdir(ORIGIN_MNT) || syscall(SYS_pivot_root, ".", ".") ||
+      umount2(".", MNT_DETACH) || chdir("/"))
+    abort();
+  if (signal(SIGHUP, SIG_DFL) == SIG_ERR || signal(SIGCHLD, SIG_DFL) == SIG_ERR)
+    abort();
+  (void)reboot(RB_ENABLE_CAD);
+  fflush(stdout);
+  static const char *const init_argv[] = {"/sbin/init", NULL};
+  execve("/sbin/init", (char *const *)init_argv, (char *const *)init_environ);
+  abort();
+}
@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+#include "tmpfs_switch_init.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/pidfd.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static char mountinfo[65536]; // this init is not threaded
+
+struct flush {
+  dev_t dev;
+  const char *mountpoint;
+};
+
+// Decodes the octal escapes of a mountinfo field in place
+static char *unescape_field(char *field) {
+  char *out = field;
+  for (const char *in = field; *in; ++out) {
+    if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] && in[3]) {
+      *out = (char)((in[1] - '0') << 6 | (in[2] - '0') << 3 | (in[3] - '0'));
+      in += 4;
+    } else {
+      *out = *in++;
+    }
+  }
+  *out = '\0';
+  return field;
+}
+
+// Filesystems with nothing to write back, or that may hang on a dead server.
+// Going by the device would skip btrfs, overlayfs and ZFS, which all use
+// anonymous 0:NN devices.
+static bool skip_fstype(const char *fstype) {
+  static const char *const SKIPPED[] = {
+      "autofs",   "binfmt_misc", "bpf",        "cgroup",   "cgroup2",
+      "cifs",     "configfs",    "debugfs",    "devpts",   "devtmpfs",
+      "efivarfs", "fuse",        "fusectl",    "hugetlbfs", "mqueue",
+      "nfs",      "nfs4",        "nfsd",       "nsfs",     "proc",
+      "pstore",   "ramfs",       "rpc_pipefs", "securityfs", "smb3",
+      "sysfs",    "tmpfs",       "tracefs",    "9p",
+  };
+  // Except fuseblk, FUSE filesystems may be served over the network
+  if (!strncmp(fstype, "fuse.", 5))
+    return true;
+  for (size_t i = 0; i < sizeof(SKIPPED) / sizeof(SKIPPED[0]); ++i) {
+    if (!strcmp(fstype, SKIPPED[i]))
+      return true;
+  }
+  return false;
+}
+
+// Collects one mountpoint per superblock worth a syncfs
+static size_t list_mounts(struct flush *flushes, size_t max) {
+  const int fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return ~(size_t)0;
+  size_t len = 0;
+  for (ssize_t ret; len < sizeof(mountinfo) - 1 &&
+                    (ret = read(fd, mountinfo + len,
+                                sizeof(mountinfo) - 1 - len));) {
+    if (ret < 0) {
+      (void)close(fd);
+      return ~(size_t)0;
+    }
+    len += ret;
+  }
+  (void)close(fd);
+  mountinfo[len] = '\0';
+  size_t count = 0;
+  for (char *line = mountinfo, *next; *line && count < max; line = next) {
+    next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+    else
+      next = line + strlen(line);
+    unsigned int major, minor;
+    int mountpoint_start, mountpoint_end;
+    char fstype[32];
+    const char *fields = strstr(line, " - ");
+    if (!fields ||
+        sscanf(line, "%*d %*d %u:%u %*s %n%*s%n", &major, &minor,
+               &mountpoint_start, &mountpoint_end) != 2 ||
+        sscanf(fields, " - %31s", fstype) != 1)
+      continue;
+    // The root always gets its syncfs, whatever it is
+    const bool root = mountpoint_end - mountpoint_start == 1 &&
+                      line[mountpoint_start] == '/';
+    if (!root && skip_fstype(fstype))
+      continue;
+    const dev_t dev = makedev(major, minor);
+    bool seen = false;
+    for (size_t i = 0; i < count; ++i)
+      seen |= flushes[i].dev == dev;
+    if (seen)
+      continue;
+    line[mountpoint_end] = '\0';
+    flushes[count++] = (struct flush){
+        .dev = dev,
+        .mountpoint = unescape_field(line + mountpoint_start),
+    };
+  }
+  return count;
+}
+
+static void print_writeback(size_t pending) {
+  const int fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+  char buf[4096];
+  const ssize_t len = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+  if (fd >= 0)
+    (void)close(fd);
+  long dirty = -1, writeback = -1;
+  if (len > 0) {
+    buf[len] = '\0';
+    const char *dirty_line = strstr(buf, "\nDirty:");
+    const char *writeback_line = strstr(buf, "\nWriteback:");
+    if (dirty_line)
+      dirty = strtol(dirty_line + sizeof("\nDirty:") - 1, NULL, 10);
+    if (writeback_line)
+      writeback = strtol(writeback_line + sizeof("\nWriteback:") - 1, NULL, 10);
+  }
+  log_msg(LOG_LEVEL_INFO, "syncfs pending %zu dirty %ld kB writeback %ld kB",
+          pending, dirty, writeback);
+  log_flush();
+}
+
+// The disk root switch-root left behind may be detached and missing from
+// mountinfo, and then only sync() reaches it
+static bool origin_listed(const struct flush *flushes, size_t count) {
+  FILE *file = fopen("/" ORIGIN_FILE, "re");
+  if (!file)
+    return false;
+  unsigned int major, minor;
+  const bool known = fscanf(file, "%u:%u", &major, &minor) == 2;
+  (void)fclose(file);
+  for (size_t i = 0; known && i < count; ++i) {
+    if (flushes[i].dev == makedev(major, minor))
+      return true;
+  }
+  return false;
+}
+
+// syncfs on the mountpoint, or sync() without one
+static void flush_one(const char *mountpoint) {
+  if (!mountpoint) {
+    sync();
+    return;
+  }
+  const int fd =
+      open(mountpoint, O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_NOFOLLOW);
+  if (fd >= 0) {
+    (void)syncfs(fd);
+    (void)close(fd);
+  }
+}
+
+void flush_mounts(void) {
+  static struct flush flushes[256];
+  // One more for the sync() that covers an unlisted origin
+  static struct pollfd children[sizeof(flushes) / sizeof(flushes[0]) + 1];
+  static pid_t pids[sizeof(children) / sizeof(children[0])];
+  size_t count = list_mounts(flushes, sizeof(flushes) / sizeof(flushes[0]));
+  if (!~count) {
+    log_msg(LOG_LEVEL_WARNING, "mountinfo unavailable, falling back to sync");
+    sync();
+    return;
+  }
+  if (!origin_listed(flushes, count))
+    flushes[count++] = (struct flush){.mountpoint = NULL};
+  size_t pending = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const char *const name =
+        flushes[i].mountpoint ? flushes[i].mountpoint : "everything";
+    const pid_t pid = fork();
+    if (pid < 0) {
+      log_msg(LOG_LEVEL_WARNING, "fork error, syncing %s inline", name);
+      flush_one(flushes[i].mountpoint);
+      continue;
+    }
+    if (!pid) {
+      flush_one(flushes[i].mountpoint);
+      _exit(0);
+    }
+    // Without a pidfd the child is polled with waitpid on each round instead
+    children[pending] = (struct pollfd){
+        .fd = pidfd_open(pid, 0),
+        .events = POLLIN,
+    };
+    pids[pending++] = pid;
+  }
+  struct timespec start;
+  if (clock_gettime(CLOCK_MONOTONIC, &start))
+    abort();
+  size_t alive = pending;
+  while (alive) {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now))
+      abort();
+    const long rem = SYNC_TIMEOUT_MS - (now.tv_sec - start.tv_sec) * 1000 -
+                     (now.tv_nsec - start.tv_nsec) / 1000000;
+    if (rem <= 0) {
+      log_msg(LOG_LEVEL_WARNING, "syncfs gave up on %zu mounts", alive);
+      break;
+    }
+    const int ready = poll(children, pending, rem < 1000 ? (int)rem : 1000);
+    if (ready < 0 && errno != EINTR)
+      abort();
+    for (size_t i = 0; i < pending; ++i) {
+      if (!pids[i])
+        continue;
+      if (children[i].fd >= 0) {
+        if (!children[i].revents)
+          continue;
+        siginfo_t info;
+        (void)waitid(P_PIDFD, children[i].fd, &info, WEXITED);
+        (void)close(children[i].fd);
+        children[i].fd = -1;
+      } else if (!waitpid(pids[i], NULL, WNOHANG)) {
+        continue;
+      }
+      pids[i] = 0;
+      --alive;
+    }
+    if (!ready && alive)
+      print_writeback(alive);
+  }
+  for (size_t i = 0; i < pending; ++i) {
+    if (children[i].fd >= 0)
+      (void)close(children[i].fd);
+  }
+  log_msg(LOG_LEVEL_INFO, "syncfs done %zu of %zu mounts", count - alive,
+          count);
+}
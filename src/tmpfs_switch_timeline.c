@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+#include "tmpfs_switch_init.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct timeline_event {
+  const char *name;
+  int64_t monotonic_ns;
+  int64_t boottime_ns;
+};
+
+static struct timeline_event timeline[32];
+static size_t timeline_len;
+
+static int64_t now_ns(clockid_t clock) {
+  struct timespec ts;
+  if (clock_gettime(clock, &ts))
+    return -1;
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void timeline_add(const char *name, int64_t monotonic_ns,
+                         int64_t boottime_ns) {
+  if (timeline_len >= sizeof(timeline) / sizeof(timeline[0]))
+    return;
+  timeline[timeline_len++] = (struct timeline_event){
+      .name = name,
+      .monotonic_ns = monotonic_ns,
+      .boottime_ns = boottime_ns,
+  };
+}
+
+void timeline_mark(const char *name) {
+  timeline_add(name, now_ns(CLOCK_MONOTONIC), now_ns(CLOCK_BOOTTIME));
+  log_flush();
+}
+
+void timeline_stamp_activate(void) {
+  const int fd = open(TARGET_DIR "/" ACTIVATE_STAMP,
+                      O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    return;
+  (void)dprintf(fd, "%" PRId64 " %" PRId64 "\n", now_ns(CLOCK_MONOTONIC),
+                now_ns(CLOCK_BOOTTIME));
+  (void)close(fd);
+}
+
+void timeline_load_activate(void) {
+  const int fd = open("/" ACTIVATE_STAMP, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  char buf[64];
+  const ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  (void)close(fd);
+  (void)unlink("/" ACTIVATE_STAMP);
+  if (len <= 0)
+    return;
+  buf[len] = '\0';
+  int64_t monotonic_ns, boottime_ns;
+  if (sscanf(buf, "%" SCNd64 " %" SCNd64, &monotonic_ns, &boottime_ns) == 2)
+    timeline_add("switch-root", monotonic_ns, boottime_ns);
+}
+
+static void timeline_write(int fd) {
+  if (!timeline_len)
+    return;
+  const struct timeline_event *first = &timeline[0];
+  const struct timeline_event *prev = first;
+  for (size_t i = 0; i < timeline_len; ++i) {
+    const struct timeline_event *e = &timeline[i];
+    (void)dprintf(fd,
+                  "timeline %-12s +%6" PRId64 " ms (step %6" PRId64
+                  " ms) boottime %" PRId64 " ms\n",
+                  e->name,
+                  (e->monotonic_ns - first->monotonic_ns) / 1000000,
+                  (e->monotonic_ns - prev->monotonic_ns) / 1000000,
+                  e->boottime_ns / 1000000);
+    prev = e;
+  }
+}
+
+void timeline_dump(void) {
+  log_flush();
+  timeline_write(1);
+  const int kmsg = open("/dev/kmsg", O_WRONLY | O_CLOEXEC | O_NOCTTY);
+  if (kmsg >= 0) {
+    // One write per line so each becomes its own record
+    const struct timeline_event *first = &timeline[0];
+    for (size_t i = 0; i < timeline_len; ++i) {
+      (void)dprintf(kmsg, "<6>tmpfs_switch_init: timeline %s +%" PRId64 " ms\n",
+                    timeline[i].name,
+                    (timeline[i].monotonic_ns - first->monotonic_ns) / 1000000);
+    }
+    (void)close(kmsg);
+  }
+  const int file = open("/" TIMELINE_FILE,
+                        O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC, 0600);
+  if (file >= 0) {
+    timeline_write(file);
+    (void)close(file);
+  }
+}
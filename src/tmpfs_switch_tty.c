@@ -25,14 +25,14 @@
 // No code was copy-and-pasted and this is under a compatible license
 
 void release_tty(void) {
-  puts("reltty");
+  log_msg(LOG_LEVEL_INFO, "reltty");
   const int dev_tty = open("/dev/tty", O_RDWR | O_CLOEXEC | O_NOCTTY);
   if (dev_tty < 0) {
     if (errno != ENXIO)
       abort();
   } else if (ioctl(dev_tty, TIOCNOTTY) || close(dev_tty))
     abort();
-  puts("relttydone");
+  log_msg(LOG_LEVEL_INFO, "relttydone");
 }
 
 static void use_tty_closing_leaks(int fd) {
@@ -149,8 +149,8 @@ static void setup_tty(void) {
   if (ioctl(0, VT_GETSTATE, &vt)) {
     vt.v_active = -2;
   }
-  printf("switched to console %d / %d\n", ioctl(0, TIOCLINUX, &fg),
-         vt.v_active);
+  log_msg(LOG_LEVEL_INFO, "switched to console %d / %d",
+          ioctl(0, TIOCLINUX, &fg), vt.v_active);
 }
 
 void activate_tty_early(void) {
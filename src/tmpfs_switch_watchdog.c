@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include "tmpfs_switch_init.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/statfs.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PRESSURE_FILE "/proc/pressure/memory"
+// The OOM killer should take whatever the work shell runs before the shell
+#define OOM_SCORE_WORK_SHELL "-900"
+#define OOM_SCORE_CHILDREN "500"
+// Share of the root in use worth a warning
+#define ROOT_FULL_PERCENT 90
+
+static pid_t work_shell;
+
+static int open_trigger(void) {
+  char trigger[64];
+  // Unprivileged triggers need whole multiples of 2 s, so match that
+  const int len = snprintf(trigger, sizeof(trigger), "some %d 2000000",
+                           PRESSURE_STALL_MS * 1000);
+  const int fd = open(PRESSURE_FILE, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0 || write(fd, trigger, len + 1) < 0) {
+    log_msg(LOG_LEVEL_INFO, "memory pressure unavailable");
+    if (fd >= 0)
+      (void)close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static unsigned int root_percent(void) {
+  struct statfs st;
+  if (statfs("/", &st) || !st.f_blocks)
+    return 0;
+  return (unsigned int)((st.f_blocks - st.f_bfree) * 100 / st.f_blocks);
+}
+
+static void warn(const char *reason) {
+  static struct timespec last;
+  static unsigned int suppressed;
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now))
+    abort();
+  if (last.tv_sec && (now.tv_sec - last.tv_sec) * 1000 +
+                             (now.tv_nsec - last.tv_nsec) / 1000000 <
+                         PRESSURE_WARN_INTERVAL_MS) {
+    ++suppressed;
+    return;
+  }
+  last = now;
+  char pressure[128] = "unavailable";
+  const int fd = open(PRESSURE_FILE, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    const ssize_t len = read(fd, pressure, sizeof(pressure) - 1);
+    (void)close(fd);
+    if (len > 0) {
+      pressure[len] = '\0';
+      pressure[strcspn(pressure, "\n")] = '\0';
+    }
+  }
+  char suppressed_note[40] = "";
+  if (suppressed)
+    snprintf(suppressed_note, sizeof(suppressed_note),
+             ", %u warnings suppressed", suppressed);
+  log_msg(LOG_LEVEL_WARNING, "watchdog: %s, root %u%% full, memory %s%s",
+          reason, root_percent(), pressure, suppressed_note);
+  log_flush();
+  suppressed = 0;
+}
+
+// With inherited, only a process still on the work shell's score is changed
+static void set_oom_score(const char *path, int procfs, const char *score,
+                          bool inherited) {
+  const int fd = openat(procfs, path, O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  char current[16];
+  const ssize_t len = read(fd, current, sizeof(current) - 1);
+  if (len > 0) {
+    current[len] = '\0';
+    // Leave alone whatever already volunteered to go first
+    if (inherited ? atoi(current) == atoi(OOM_SCORE_WORK_SHELL)
+                  : score[0] == '-' || atoi(current) < atoi(score))
+      (void)pwrite(fd, score, strlen(score), 0);
+  }
+  (void)close(fd);
+}
+
+static void sacrifice_children(int procfs, pid_t pid, const char *d_name) {
+  if (pid == work_shell)
+    return;
+  char path[32];
+  snprintf(path, sizeof(path), "%s/oom_score_adj", d_name);
+  set_oom_score(path, procfs, OOM_SCORE_CHILDREN, false);
+}
+
+// Each new process that inherited the shell's score is moved ahead of it, so
+// a child forking before it is seen still has its own children caught
+static void retag_forks(int fd, int procfs) {
+  static char buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+  for (ssize_t len;;) {
+    len = recv(fd, buf, sizeof(buf), 0);
+    if (len < 0 && errno == ENOBUFS) {
+      log_msg(LOG_LEVEL_INFO, "fork events lost, retagging all processes");
+      for_each_process(procfs, sacrifice_children);
+      continue;
+    }
+    if (len <= 0)
+      return;
+    for (const struct nlmsghdr *nl = (const struct nlmsghdr *)buf;
+         NLMSG_OK(nl, (size_t)len); nl = NLMSG_NEXT(nl, len)) {
+      const struct cn_msg *cn = NLMSG_DATA(nl);
+      const struct proc_event *event = (const struct proc_event *)cn->data;
+      if (event->what != PROC_EVENT_FORK ||
+          event->event_data.fork.child_pid !=
+              event->event_data.fork.child_tgid ||
+          event->event_data.fork.child_tgid == work_shell)
+        continue;
+      char path[32];
+      snprintf(path, sizeof(path), "%d/oom_score_adj",
+               event->event_data.fork.child_tgid);
+      set_oom_score(path, procfs, OOM_SCORE_CHILDREN, true);
+    }
+  }
+}
+
+// Returns whether the work shell was among the reaped
+static bool reap(void) {
+  bool exited = false;
+  for (pid_t pid; (pid = waitpid(-1, NULL, WNOHANG)) > 0;)
+    exited |= pid == work_shell;
+  return exited;
+}
+
+void watch_work_shell(pid_t work_pid) {
+  work_shell = work_pid;
+  const int procfs = open("/proc", O_CLOEXEC | O_DIRECTORY);
+  if (procfs < 0)
+    abort();
+  // Listening before the shell gets its score, so no fork inherits it unseen
+  const int proc_events = open_proc_events();
+  if (proc_events < 0) {
+    log_msg(LOG_LEVEL_INFO,
+            "fork events unavailable, the shell's children are only "
+            "retagged under memory pressure");
+  }
+  {
+    char path[32];
+    snprintf(path, sizeof(path), "%d/oom_score_adj", work_pid);
+    set_oom_score(path, procfs, OOM_SCORE_WORK_SHELL, false);
+  }
+  // Blocked only now so the work shell doesn't inherit the mask
+  sigset_t chld;
+  if (sigemptyset(&chld) || sigaddset(&chld, SIGCHLD) ||
+      sigprocmask(SIG_BLOCK, &chld, NULL))
+    abort();
+  struct pollfd fds[] = {
+      {.fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC), .events = POLLIN},
+      {.fd = open_trigger(), .events = POLLPRI},
+      {.fd = proc_events, .events = POLLIN},
+  };
+  if (fds[0].fd < 0)
+    abort();
+  for (bool done = reap(); !done;) {
+    if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      abort();
+    }
+    if (fds[2].revents & POLLIN)
+      retag_forks(fds[2].fd, procfs);
+    if (fds[1].revents & POLLERR) {
+      log_msg(LOG_LEVEL_WARNING, "memory pressure trigger lost");
+      log_flush();
+      (void)close(fds[1].fd);
+      fds[1].fd = -1;
+    } else if (fds[1].revents & POLLPRI) {
+      warn("memory pressure");
+      for_each_process(procfs, sacrifice_children);
+    }
+    if (fds[0].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      while (read(fds[0].fd, &info, sizeof(info)) == sizeof(info))
+        ;
+      done = reap();
+      if (!done && root_percent() >= ROOT_FULL_PERCENT)
+        warn("root filling up");
+    }
+  }
+  if (close(fds[0].fd) || (fds[1].fd >= 0 && close(fds[1].fd)) ||
+      (fds[2].fd >= 0 && close(fds[2].fd)) || close(procfs) ||
+      sigprocmask(SIG_UNBLOCK, &chld, NULL))
+    abort();
+}
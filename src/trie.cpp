@@ -43,6 +43,10 @@ bool Trie::HasPath(string_view path) const {
   return FindPath(path).second.empty();
 }
 
+bool Trie::CoversPath(string_view path) const {
+  return !FindPath(path).first.get().child;
+}
+
 void Trie::AddPath(string_view path) {
   auto [base, rem] = FindPath(path);
   unique_ptr<vector<Trie>> *tree = &base.get().child;
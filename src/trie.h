@@ -25,5 +25,8 @@ public:
 
   [[nodiscard]] bool HasPath(std::string_view path) const;
 
+  // Whether path is an added path or lies beneath one
+  [[nodiscard]] bool CoversPath(std::string_view path) const;
+
   void AddPath(std::string_view path);
 };
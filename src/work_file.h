@@ -1,11 +1,33 @@
 #pragma once
 
 #define WORK_FILE_NAME "tmpfs_bom.txt"
+#define REPORT_FILE_NAME "tmpfs_footprint.txt"
+// Files opened under the record command, one path per line
+#define PROFILE_FILE_NAME "tmpfs_profile.txt"
+// Entries build_ramdisk --keep-going left out, with the reason
+#define SKIPPED_FILE_NAME "tmpfs_skipped.txt"
 #define TARGET_DIR "/cdrom"
 
+// Created in the target once the critical tier and init are in place
+#define CRITICAL_MARKER ".tmpfs_switch_critical"
+// Created in the target once the bulk tier has been copied too
+#define READY_MARKER ".tmpfs_switch_ready"
+// Percentage of the bulk tier copied so far
+#define PROGRESS_FILE ".tmpfs_switch_progress"
+// Checkpoints of the BOM copied so far, for build_ramdisk --resume
+#define JOURNAL_FILE ".tmpfs_switch_journal"
+
 enum {
 COPY_EXE = 'E',
 COPY_DAT = 'F',
 COPY_DIR = 'D',
 COPY_LNK = 'L',
+// Regular files whose contents are in the data section, as
+// <type><offset> <size><path> with the offset counted from its start
+COPY_EXE_INLINE = 'e',
+COPY_DAT_INLINE = 'f',
+// Line on its own separating the critical tier from the bulk tier
+TIER_BULK = 'B',
+// Line on its own after the last entry, followed by the inlined contents
+DATA_SECTION = 'P',
 };